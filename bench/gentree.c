@@ -0,0 +1,197 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../common.h"
+
+enum {
+	STREAMSIZE,
+	STREAMCHANGED,
+	STREAMDATA,
+	STREAMORDER,
+};
+
+static char *argv0;
+static uint64_t seed = 1;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-n files] [-s minsize] [-S maxsize] [-f fanout] [-d depth] [-c changed] [-r seed] dir\n", argv0);
+	exit(1);
+}
+
+static uint64_t
+next(uint64_t *x)
+{
+	uint64_t z;
+
+	/* splitmix64 */
+	z = *x += 0x9e3779b97f4a7c15;
+	z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9;
+	z = (z ^ z >> 27) * 0x94d049bb133111eb;
+	return z ^ z >> 31;
+}
+
+/* an independent generator for each (file, purpose), so one parameter does not perturb the others */
+static uint64_t
+stream(uint64_t i, int kind)
+{
+	uint64_t x;
+
+	x = seed;
+	x = next(&x) ^ i;
+	x = next(&x) ^ kind;
+	return next(&x);
+}
+
+static unsigned long
+num(const char *s)
+{
+	char *end;
+	unsigned long n;
+
+	n = strtoul(s, &end, 10);
+	if (*end)
+		usage();
+	return n;
+}
+
+static void
+writefile(const char *name, off_t size, uint64_t x)
+{
+	static uint64_t buf[8192];
+	size_t len, i;
+	ssize_t ret;
+	int fd;
+
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		fatal("open %s:", name);
+	while (size > 0) {
+		len = size < sizeof(buf) ? size : sizeof(buf);
+		for (i = 0; i < (len + 7) / 8; ++i)
+			buf[i] = next(&x);
+		ret = write(fd, buf, len);
+		if (ret < 0)
+			fatal("write %s:", name);
+		size -= ret;
+	}
+	if (close(fd) != 0)
+		fatal("close %s:", name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long nfiles = 10000, minsize = 0, maxsize = 65536, fanout = 16, depth = 3;
+	unsigned long ndirs, width, i, j, bits, *order, tmp;
+	double changed = 0;
+	char **dirs, *name, *end;
+	size_t namemax;
+	off_t size;
+	uint64_t x;
+
+	argv0 = argc ? argv[0] : "gentree";
+	ARGBEGIN {
+	case 'n':
+		nfiles = num(EARGF(usage()));
+		break;
+	case 's':
+		minsize = num(EARGF(usage()));
+		break;
+	case 'S':
+		maxsize = num(EARGF(usage()));
+		break;
+	case 'f':
+		fanout = num(EARGF(usage()));
+		break;
+	case 'd':
+		depth = num(EARGF(usage()));
+		break;
+	case 'c':
+		changed = strtod(EARGF(usage()), &end);
+		if (*end || changed < 0 || changed > 1)
+			usage();
+		break;
+	case 'r':
+		seed = num(EARGF(usage()));
+		break;
+	default:
+		usage();
+	} ARGEND
+	if (argc != 1 || fanout == 0 || minsize > maxsize)
+		usage();
+
+	/* directories are numbered breadth-first, so the parent of d is (d - 1) / fanout */
+	ndirs = 1;
+	for (width = 1, i = 0; i < depth; ++i) {
+		width *= fanout;
+		ndirs += width;
+	}
+	dirs = reallocarray(NULL, ndirs, sizeof(dirs[0]));
+	if (!dirs)
+		fatal(NULL);
+	dirs[0] = argv[0];
+	if (mkdir(dirs[0], 0755) != 0 && errno != EEXIST)
+		fatal("mkdir %s:", dirs[0]);
+	for (i = 1; i < ndirs; ++i) {
+		namemax = strlen(dirs[(i - 1) / fanout]) + 24;
+		dirs[i] = malloc(namemax);
+		if (!dirs[i])
+			fatal(NULL);
+		snprintf(dirs[i], namemax, "%s/d%lu", dirs[(i - 1) / fanout], (i - 1) % fanout);
+		if (mkdir(dirs[i], 0755) != 0 && errno != EEXIST)
+			fatal("mkdir %s:", dirs[i]);
+	}
+
+	/* sizes are log-uniform, so small files dominate as in real trees */
+	namemax = strlen(dirs[ndirs - 1]) + 24;
+	name = malloc(namemax);
+	if (!name)
+		fatal(NULL);
+	for (bits = 0; bits < 64 && (maxsize - minsize) >> bits; ++bits)
+		;
+	for (i = 0; i < nfiles; ++i) {
+		snprintf(name, namemax, "%s/f%lu", dirs[i % ndirs], i);
+		x = stream(i, STREAMSIZE);
+		size = minsize + next(&x) % (((maxsize - minsize) >> next(&x) % (bits + 1)) + 1);
+		x = stream(i, STREAMDATA);
+		if (stream(i, STREAMCHANGED) < changed * 0x1p64)
+			x = ~x;
+		writefile(name, size, x);
+	}
+
+	/* emit the manifest shuffled, so fspec-sort has real work to do */
+	order = reallocarray(NULL, ndirs + nfiles, sizeof(order[0]));
+	if (!order)
+		fatal(NULL);
+	for (i = 0; i < ndirs + nfiles; ++i)
+		order[i] = i;
+	x = stream(0, STREAMORDER);
+	for (i = ndirs + nfiles; i > 1; --i) {
+		j = next(&x) % i;
+		tmp = order[i - 1];
+		order[i - 1] = order[j];
+		order[j] = tmp;
+	}
+	for (i = 0; i < ndirs + nfiles; ++i) {
+		j = order[i];
+		if (j == 0) {
+			fputs("/\ntype=dir\nmode=0755\n\n", stdout);
+		} else if (j < ndirs) {
+			printf("%s\ntype=dir\nmode=0755\n\n", dirs[j] + strlen(dirs[0]));
+		} else {
+			j -= ndirs;
+			printf("%s/f%lu\ntype=reg\nmode=0644\nsource=%s/f%lu\n\n", dirs[j % ndirs] + strlen(dirs[0]), j, dirs[j % ndirs], j);
+		}
+	}
+	fflush(stdout);
+	if (ferror(stdout))
+		fatal("write:");
+}
@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "../common.h"
+
+static char *argv0;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-n iterations] [-s statsfile] fspec\n", argv0);
+	exit(1);
+}
+
+static void
+fspec(char *pos, size_t len)
+{
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long n = 10, i;
+	char *end;
+	FILE *file;
+
+	argv0 = argc ? argv[0] : "parsebench";
+	ARGBEGIN {
+	case 'n':
+		n = strtoul(EARGF(usage()), &end, 10);
+		if (*end)
+			usage();
+		break;
+	case 's':
+		statsinit(EARGF(usage()));
+		break;
+	default:
+		usage();
+	} ARGEND
+	if (argc != 1)
+		usage();
+
+	file = fopen(argv[0], "r");
+	if (!file)
+		fatal("open %s:", argv[0]);
+	for (i = 0; i < n; ++i) {
+		parse(file, fspec);
+		rewind(file);
+	}
+	statsprint();
+}
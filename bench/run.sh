@@ -0,0 +1,68 @@
+#!/bin/sh
+# usage: run.sh workdir
+# Times each tool over a generated tree. The tree shape comes from the
+# environment: FILES, MINSIZE, MAXSIZE, FANOUT, DEPTH, CHANGED, SEED.
+
+set -e
+
+bin=$(cd "$(dirname "$0")/.." && pwd)
+work=$1
+: "${FILES:=10000}" "${MINSIZE:=0}" "${MAXSIZE:=65536}" "${FANOUT:=16}" "${DEPTH:=3}" "${CHANGED:=0.01}" "${SEED:=1}"
+gen="$bin/bench/gentree -n $FILES -s $MINSIZE -S $MAXSIZE -f $FANOUT -d $DEPTH -r $SEED"
+
+rm -rf "$work"
+mkdir -p "$work"
+cd "$work"
+
+# report name records bytes: one line from the stats written to ./stats,
+# where records and bytes are counter names or literal numbers, and a
+# bytes of - leaves the byte columns empty
+report() {
+	awk -v name="$1" -v rkey="$2" -v bkey="$3" '
+	BEGIN { records = rkey + 0; bytes = bkey + 0 }
+	$1 == rkey { records = $2 }
+	$1 == bkey { bytes = $2 }
+	$1 == "time.total.wall" { secs = $2 }
+	END {
+		if (secs <= 0)
+			secs = 1e-9
+		if (bkey == "-")
+			printf "%-14s %10d %12s %10.3f %12.0f %10s\n", name, records, "-", secs, records / secs, "-"
+		else
+			printf "%-14s %10d %12.1f %10.3f %12.0f %10.1f\n", name, records, bytes / 1e6, secs, records / secs, bytes / 1e6 / secs
+	}' stats
+}
+
+$gen src >m1.raw
+printf '%-14s %10s %12s %10s %12s %10s\n' scenario records MB seconds records/s MB/s
+
+"$bin/fspec-sort" -s stats <m1.raw >m1.sorted
+report sort records "$(wc -c <m1.raw)"
+
+"$bin/fspec-hash" -s stats <m1.sorted >m1
+report hash records bytes_hashed
+
+"$bin/fspec-scan" -H -s stats src >/dev/null
+report scan records bytes_hashed
+
+"$bin/bench/parsebench" -n 10 -s stats m1
+report parse records "$(($(wc -c <m1) * 10))"
+
+"$bin/fspec-tar" -s stats <m1 >/dev/null
+report tar records bytes_copied
+
+mkdir dst
+"$bin/fspec-sync" -s stats dst m1 >/dev/null
+report sync-cold records bytes_copied
+
+"$bin/fspec-sync" -s stats dst m1 >/dev/null
+report sync-noop records bytes_hashed
+
+$gen -c "$CHANGED" src >m2.raw
+"$bin/fspec-sort" <m2.raw | "$bin/fspec-hash" >m2
+"$bin/fspec-sync" -s stats dst m2 >/dev/null
+report sync-changed records bytes_copied
+
+printf '/\ntype=dir\nmode=0755\n\n' >empty
+"$bin/fspec-sync" -s stats dst empty >/dev/null
+report sync-delete deleted -
@@ -1,5 +1,6 @@
 #include <stddef.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 #define ARGBEGIN \
 	for (;;) { \
@@ -28,4 +29,124 @@ void fatal(const char *, ...);
 void *reallocarray(void *, size_t, size_t);
 
 /* parse.c */
-void parse(FILE *, void (*)(char *, size_t));
\ No newline at end of file
+void parse(FILE *, void (*)(char *, size_t));
+
+/* path.c */
+int pathcmp(const char *, const char *, const char **);
+void checkpath(const char *, const char *);
+
+/* stage.c */
+struct stage {
+	/* may modify the record text, but must not keep it after returning */
+	void (*record)(struct stage *, char *, size_t);
+	void (*end)(struct stage *);
+	struct stage *next;
+};
+
+void stagefeed(struct stage *, FILE *);
+struct stage *writestage(void);
+
+/* scan.c */
+struct scanopt {
+	int threads; /* or 0 for one per CPU */
+	int hash;    /* add blake3 attributes */
+};
+
+void scanfeed(struct stage *, const char *, const struct scanopt *);
+
+/* sort.c */
+struct stage *sortstage(int, struct stage *);
+
+/* hash.c */
+struct stage *hashstage(struct stage *);
+
+/* tree.c */
+struct stage *treestage(struct stage *);
+
+/* tar.c */
+struct stage *tarstage(void);
+struct stage *shardstage(const char *, size_t);
+
+/* sync.c */
+enum {
+	SYNCDRYRUN = 1 << 0,
+	SYNCURING  = 1 << 1,
+	SYNCSHADOW = 1 << 2,
+};
+
+enum {
+	DURABLENONE,
+	DURABLEBATCH,
+	DURABLESTRICT,
+};
+
+struct syncopt {
+	int srcdir;      /* sources are relative to this directory */
+	int tarfd;       /* or, if not -1, file data comes from this archive stream */
+	int flags;
+	int durability;
+	char *statefile; /* directory digests applied, to skip unchanged subtrees */
+};
+
+struct stage *syncstage(char *, const struct syncopt *);
+
+/* verify.c */
+struct verifyopt {
+	int threads; /* hashing threads, or 0 for one per CPU */
+	double rate; /* fraction of regular files to hash */
+};
+
+struct stage *verifystage(char *, const struct verifyopt *);
+unsigned long long verifydiffs(void);
+
+/* uring.c */
+struct statx;
+struct uring *uringnew(unsigned);
+int uringstatx(struct uring *, void *, int, const char *, int, unsigned, struct statx *);
+int uringopenat(struct uring *, void *, int, const char *, int);
+int uringread(struct uring *, void *, int, void *, size_t, off_t);
+int uringwait(struct uring *, void **, int *);
+
+/* stats.c */
+enum {
+	STATRECORDS,
+	STATHASHED,
+	STATCOPIED,
+	STATUNCHANGED,
+	STATDELETED,
+	STATSYSCALLS,
+	STATMISMATCHED,
+	STATSORTBYTES,
+	NSTATS,
+};
+
+enum {
+	PHASEOTHER,
+	PHASEPARSE,
+	PHASESTAT,
+	PHASESCANDIR,
+	PHASEPREFETCH,
+	PHASEHASH,
+	PHASEFETCH,
+	PHASERENAME,
+	PHASEDELETE,
+	PHASESORT,
+	PHASEHEADER,
+	PHASEWRITE,
+	NPHASES,
+};
+
+extern unsigned long long stats[NSTATS];
+extern const char *const phasenames[NPHASES];
+void statsinit(const char *);
+int statphase(int);
+void statsprint(void);
+
+/* trace.c */
+extern int tracing;
+void traceinit(const char *);
+long long tracenow(void);
+const char *tracerecord(const char *);
+void tracespan(int, const char *, long long, long long);
+void tracephase(int, long long, long long);
+void tracewrite(void);
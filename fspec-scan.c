@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "common.h"
+
+static char *argv0;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-Hm] [-j threads] [-s statsfile] [-T tracefile] dir\n", argv0);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct stage *s;
+	struct scanopt opt = {0};
+	char *end;
+	int mflag = 0;
+
+	argv0 = argc ? argv[0] : "fspec-scan";
+	ARGBEGIN {
+	case 'H':
+		opt.hash = 1;
+		break;
+	case 'j':
+		opt.threads = strtol(EARGF(usage()), &end, 10);
+		if (*end || opt.threads <= 0)
+			usage();
+		break;
+	case 'm':
+		mflag = 1;
+		break;
+	case 's':
+		statsinit(EARGF(usage()));
+		break;
+	case 'T':
+		traceinit(EARGF(usage()));
+		break;
+	default:
+		usage();
+	} ARGEND
+	if (argc != 1)
+		usage();
+
+	s = writestage();
+	if (mflag)
+		s = treestage(s);
+	scanfeed(s, argv[0], &opt);
+	s->end(s);
+	statsprint();
+	tracewrite();
+}
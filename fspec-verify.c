@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "common.h"
+
+static char *argv0;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-j threads] [-r rate] [-s statsfile] [-T tracefile] rootdir [fspecfile]\n"
+		"exits 0 if the tree matches, 2 if it differs, and 1 on error\n", argv0);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct stage *s;
+	struct verifyopt opt = {.rate = 1};
+	char *end;
+
+	argv0 = argc ? argv[0] : "fspec-verify";
+	ARGBEGIN {
+	case 'j':
+		opt.threads = strtol(EARGF(usage()), &end, 10);
+		if (*end || opt.threads <= 0)
+			usage();
+		break;
+	case 'r':
+		opt.rate = strtod(EARGF(usage()), &end);
+		if (*end || !(opt.rate > 0 && opt.rate <= 1))
+			usage();
+		break;
+	case 's':
+		statsinit(EARGF(usage()));
+		break;
+	case 'T':
+		traceinit(EARGF(usage()));
+		break;
+	default:
+		usage();
+	} ARGEND
+	if (argc == 2) {
+		if (!freopen(argv[1], "r", stdin))
+			fatal("open %s:", argv[1]);
+	} else if (argc != 1) {
+		usage();
+	}
+
+	s = verifystage(argv[0], &opt);
+	stagefeed(s, stdin);
+	s->end(s);
+	statsprint();
+	tracewrite();
+	/* 1 is left to fatal() for errors */
+	return verifydiffs() ? 2 : 0;
+}
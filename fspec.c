@@ -0,0 +1,103 @@
+#define _GNU_SOURCE /* for AT_FDCWD */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "common.h"
+
+static char *argv0;
+static int mflag, pflag;
+static struct syncopt syncopt = {.srcdir = AT_FDCWD, .tarfd = -1, .durability = DURABLENONE};
+static struct verifyopt verifyopt = {.rate = 1};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-dmpux] [-j threads] [-M statefile] [-r rate] [-S none|batch|strict] [-s statsfile] [-T tracefile] [sort] [hash] [tar | sync rootdir | verify rootdir]\n", argv0);
+	exit(1);
+}
+
+/* each stage has static state, so a stage may appear only once and in this order */
+static struct stage *
+pipeline(char **argv, int from)
+{
+	if (!*argv)
+		return writestage();
+	if (from <= 0 && strcmp(*argv, "sort") == 0)
+		return sortstage(pflag, pipeline(argv + 1, 1));
+	if (from <= 1 && strcmp(*argv, "hash") == 0)
+		return hashstage(mflag ? treestage(pipeline(argv + 1, 2)) : pipeline(argv + 1, 2));
+	if (strcmp(*argv, "tar") == 0 && !argv[1])
+		return tarstage();
+	if (strcmp(*argv, "sync") == 0 && argv[1] && !argv[2])
+		return syncstage(argv[1], &syncopt);
+	if (strcmp(*argv, "verify") == 0 && argv[1] && !argv[2])
+		return verifystage(argv[1], &verifyopt);
+	usage();
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct stage *s;
+	char *arg, *end;
+
+	argv0 = argc ? argv[0] : "fspec";
+	ARGBEGIN {
+	case 'd':
+		syncopt.flags |= SYNCDRYRUN;
+		break;
+	case 'j':
+		verifyopt.threads = strtol(EARGF(usage()), &end, 10);
+		if (*end || verifyopt.threads <= 0)
+			usage();
+		break;
+	case 'm':
+		mflag = 1;
+		break;
+	case 'M':
+		syncopt.statefile = EARGF(usage());
+		break;
+	case 'p':
+		pflag = 1;
+		break;
+	case 'r':
+		verifyopt.rate = strtod(EARGF(usage()), &end);
+		if (*end || !(verifyopt.rate > 0 && verifyopt.rate <= 1))
+			usage();
+		break;
+	case 'u':
+		syncopt.flags |= SYNCURING;
+		break;
+	case 'x':
+		syncopt.flags |= SYNCSHADOW;
+		break;
+	case 'S':
+		arg = EARGF(usage());
+		if (strcmp(arg, "none") == 0)
+			syncopt.durability = DURABLENONE;
+		else if (strcmp(arg, "batch") == 0)
+			syncopt.durability = DURABLEBATCH;
+		else if (strcmp(arg, "strict") == 0)
+			syncopt.durability = DURABLESTRICT;
+		else
+			usage();
+		break;
+	case 's':
+		statsinit(EARGF(usage()));
+		break;
+	case 'T':
+		traceinit(EARGF(usage()));
+		break;
+	default:
+		usage();
+	} ARGEND
+
+	s = pipeline(argv, 0);
+	stagefeed(s, stdin);
+	s->end(s);
+	statsprint();
+	tracewrite();
+	return verifydiffs() ? 2 : 0;
+}
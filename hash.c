@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <blake3.h>
+#include "common.h"
+
+static char *out;
+static size_t outmax;
+
+static void
+hashrecord(struct stage *s, char *pos, size_t len)
+{
+	FILE *file;
+	blake3_hasher ctx;
+	char buf[16384], *source, *line, *end;
+	unsigned char hash[BLAKE3_OUT_LEN];
+	size_t sourcelen, n, i;
+	int reg = 0, phase;
+
+	end = memchr(pos, '\n', len);
+	source = pos + 1;
+	sourcelen = end - source;
+	for (line = end + 1; line < pos + len; line = end + 1) {
+		end = memchr(line, '\n', pos + len - line);
+		if (end - line == 8 && memcmp(line, "type=reg", 8) == 0) {
+			reg = 1;
+		} else if (end - line >= 7 && memcmp(line, "source=", 7) == 0) {
+			source = line + 7;
+			sourcelen = end - source;
+		} else if (end - line >= 7 && memcmp(line, "blake3=", 7) == 0) {
+			reg = 0;
+			break;
+		}
+	}
+	if (!reg) {
+		s->next->record(s->next, pos, len);
+		return;
+	}
+
+	phase = statphase(PHASEHASH);
+	source[sourcelen] = '\0';
+	file = fopen(source, "rb");
+	if (!file)
+		fatal("open %s:", source);
+	blake3_hasher_init(&ctx);
+	do {
+		n = fread(buf, 1, sizeof(buf), file);
+		blake3_hasher_update(&ctx, buf, n);
+		stats[STATHASHED] += n;
+	} while (n == sizeof(buf));
+	if (ferror(file))
+		fatal("read %s:", source);
+	blake3_hasher_finalize(&ctx, hash, sizeof(hash));
+	fclose(file);
+	source[sourcelen] = '\n';
+	statphase(phase);
+
+	if (outmax < len + 8 + 2 * sizeof(hash)) {
+		outmax = len + 8 + 2 * sizeof(hash);
+		free(out);
+		out = malloc(outmax);
+		if (!out)
+			fatal(NULL);
+	}
+	memcpy(out, pos, len);
+	n = len;
+	memcpy(out + n, "blake3=", 7);
+	n += 7;
+	for (i = 0; i < sizeof(hash); ++i, n += 2) {
+		out[n] = "0123456789abcdef"[hash[i] >> 4];
+		out[n + 1] = "0123456789abcdef"[hash[i] & 0xf];
+	}
+	out[n++] = '\n';
+	s->next->record(s->next, out, n);
+}
+
+static void
+hashend(struct stage *s)
+{
+	s->next->end(s->next);
+}
+
+/* a filter that adds a blake3 attribute to regular files that lack one */
+struct stage *
+hashstage(struct stage *next)
+{
+	static struct stage s = {hashrecord, hashend};
+
+	s.next = next;
+	return &s;
+}
@@ -9,7 +9,9 @@ parse(FILE *file, void (*fspec)(char *, size_t))
 	char bufstack[8192], *bufalloc = NULL;
 	char *buf = bufstack, *pos, *end, *rec;
 	size_t len, max = sizeof(bufstack);
+	int phase;
 
+	phase = statphase(PHASEPARSE);
 	rec = buf;
 	pos = buf;
 	do {
@@ -54,6 +56,7 @@ parse(FILE *file, void (*fspec)(char *, size_t))
 			len -= end + 1 - pos;
 			pos = end + 1;
 			if (end > rec && end[-1] == '\n') {
+				++stats[STATRECORDS];
 				fspec(rec, end - rec);
 				goto next;
 			}
@@ -62,7 +65,9 @@ parse(FILE *file, void (*fspec)(char *, size_t))
 	if (pos - rec + len > 0) {
 		if (pos[len - 1] != '\n')
 			fatal("invalid fspec: truncated");
+		++stats[STATRECORDS];
 		fspec(rec, pos - rec + len);
 	}
 	free(bufalloc);
+	statphase(phase);
 }
@@ -0,0 +1,29 @@
+#include <string.h>
+#include "common.h"
+
+/* compare manifest paths, where '/' sorts before any other byte; end is set to where p2 first differs */
+int
+pathcmp(const char *p1, const char *p2, const char **end)
+{
+	char c1, c2;
+
+	for (; *p1 == *p2 && *p1; ++p1, ++p2)
+		;
+	if (end)
+		*end = p2;
+	c1 = *p1, c2 = *p2;
+	return c1 && c2 ? (c1 == '/' ? 0 : c1) - (c2 == '/' ? 0 : c2) : !c2 - !c1;
+}
+
+/* check that p2 may follow p1 in a manifest: sorted, and with its directory already seen */
+void
+checkpath(const char *p1, const char *p2)
+{
+	const char *end;
+
+	if (pathcmp(p1, p2, &end) >= 0)
+		fatal("not sorted at %s", p2);
+	end = strchr(end + 1, '/');
+	if (end)
+		fatal("missing directory %.*s", end - p2, p2);
+}
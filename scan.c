@@ -0,0 +1,455 @@
+#define _GNU_SOURCE /* for statx, struct dirent64 */
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <blake3.h>
+#include "common.h"
+
+enum {
+	DIRBUF = 65536,
+};
+
+/* a file of the tree; a directory has its sorted children once it is done */
+struct node {
+	struct node *parent, **child;
+	size_t nchild;
+	mode_t mode;
+	off_t size;
+	char *target;
+	int done;
+	unsigned char hash[BLAKE3_OUT_LEN];
+	char name[];
+};
+
+/* the jobs of one worker: it takes from the back, and idle workers steal from the front */
+struct queue {
+	pthread_mutex_t lock;
+	struct node **job;
+	size_t head, tail, max;
+};
+
+static struct queue *queues;
+static long nqueues;
+static int rootfd = -1, hflag;
+static char *prefix, *path, *rec;
+static size_t prefixlen, pathlen, pathmax, recmax;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	int sleeping;
+	struct node *wait; /* the node the output is waiting for */
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static struct node *
+mknode(struct node *parent, const char *name)
+{
+	struct node *n;
+	size_t len;
+
+	len = strlen(name);
+	n = malloc(sizeof(*n) + len + 1);
+	if (!n)
+		fatal(NULL);
+	memcpy(n->name, name, len + 1);
+	n->parent = parent;
+	n->child = NULL;
+	n->nchild = 0;
+	n->target = NULL;
+	n->done = 0;
+	return n;
+}
+
+/* the path of a node relative to the root, for the worker threads */
+static char *
+nodepath(struct node *n)
+{
+	struct node *p;
+	size_t len;
+	char *buf, *pos;
+
+	if (!n->parent)
+		return strdup(".");
+	len = 0;
+	for (p = n; p->parent; p = p->parent)
+		len += strlen(p->name) + 1;
+	buf = malloc(len);
+	if (!buf)
+		fatal(NULL);
+	pos = buf + len;
+	*--pos = '\0';
+	for (p = n; p->parent; p = p->parent) {
+		pos -= strlen(p->name);
+		memcpy(pos, p->name, strlen(p->name));
+		if (pos > buf)
+			*--pos = '/';
+	}
+	return buf;
+}
+
+static int
+nodecmp(const void *p1, const void *p2)
+{
+	return pathcmp((*(struct node **)p1)->name, (*(struct node **)p2)->name, NULL);
+}
+
+static void
+finish(struct node *n, unsigned long long nsys, unsigned long long nhashed)
+{
+	pthread_mutex_lock(&pool.lock);
+	n->done = 1;
+	stats[STATSYSCALLS] += nsys;
+	stats[STATHASHED] += nhashed;
+	if (pool.wait == n)
+		pthread_cond_signal(&pool.done);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* queue jobs so that the owner takes them in order */
+static void
+push(struct queue *q, struct node **job, size_t len)
+{
+	if (len == 0)
+		return;
+	pthread_mutex_lock(&q->lock);
+	if (q->head > 0) {
+		memmove(q->job, q->job + q->head, (q->tail - q->head) * sizeof(q->job[0]));
+		q->tail -= q->head;
+		q->head = 0;
+	}
+	if (q->tail + len > q->max) {
+		q->max = q->tail + len > q->max * 2 ? q->tail + len : q->max * 2;
+		q->job = reallocarray(q->job, q->max, sizeof(q->job[0]));
+		if (!q->job)
+			fatal(NULL);
+	}
+	while (len > 0)
+		q->job[q->tail++] = job[--len];
+	pthread_mutex_unlock(&q->lock);
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.sleeping)
+		pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static struct node *
+take(struct queue *q, int steal)
+{
+	struct node *n = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail)
+		n = steal ? q->job[q->head++] : q->job[--q->tail];
+	pthread_mutex_unlock(&q->lock);
+	return n;
+}
+
+/* take a job from another worker, starting after q */
+static struct node *
+steal(struct queue *q)
+{
+	struct node *n;
+	long i, j;
+
+	i = q - queues;
+	for (j = 1; j <= nqueues; ++j) {
+		n = take(&queues[(i + j) % nqueues], 1);
+		if (n)
+			return n;
+	}
+	return NULL;
+}
+
+/* list a directory, stat its entries, and queue the subdirectories and files to hash */
+static void
+listdir(struct node *n, struct queue *q, char *buf)
+{
+	struct dirent64 *ent;
+	struct statx stx;
+	struct node *c, **job;
+	char *name;
+	size_t max = 0, njob = 0, off, i;
+	ssize_t ret, len;
+	unsigned long long nsys = 2;
+	int fd;
+
+	name = nodepath(n);
+	fd = openat(rootfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		fatal("open %s/%s:", prefix, name);
+	while (++nsys, (ret = syscall(SYS_getdents64, fd, buf, DIRBUF)) != 0) {
+		if (ret < 0)
+			fatal("getdents %s/%s:", prefix, name);
+		for (off = 0; off < ret; off += ent->d_reclen) {
+			const char *e;
+
+			ent = (struct dirent64 *)(buf + off);
+			e = ent->d_name;
+			if (e[0] == '.' && (!e[1] || (e[1] == '.' && !e[2])))
+				continue;
+			++nsys;
+			if (statx(fd, e, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_MODE | STATX_SIZE, &stx) != 0)
+				fatal("stat %s/%s/%s:", prefix, name, e);
+			c = mknode(n, e);
+			c->mode = stx.stx_mode;
+			c->size = stx.stx_size;
+			switch (c->mode & S_IFMT) {
+			case S_IFDIR:
+				break;
+			case S_IFREG:
+				c->done = !hflag;
+				break;
+			case S_IFLNK:
+				for (i = c->size + 1;; i *= 2) {
+					c->target = realloc(c->target, i);
+					if (!c->target)
+						fatal(NULL);
+					++nsys;
+					len = readlinkat(fd, e, c->target, i);
+					if (len < 0)
+						fatal("readlink %s/%s/%s:", prefix, name, e);
+					if (len < i)
+						break;
+				}
+				c->target[len] = '\0';
+				c->done = 1;
+				break;
+			default:
+				fatal("file '%s/%s/%s' has unsupported type", prefix, name, e);
+			}
+			if (n->nchild == max) {
+				max = max ? max * 2 : 64;
+				n->child = reallocarray(n->child, max, sizeof(n->child[0]));
+				if (!n->child)
+					fatal(NULL);
+			}
+			n->child[n->nchild++] = c;
+		}
+	}
+	close(fd);
+	free(name);
+	qsort(n->child, n->nchild, sizeof(n->child[0]), nodecmp);
+
+	job = reallocarray(NULL, n->nchild, sizeof(job[0]));
+	if (n->nchild && !job)
+		fatal(NULL);
+	for (i = 0; i < n->nchild; ++i) {
+		if (!n->child[i]->done)
+			job[njob++] = n->child[i];
+	}
+	push(q, job, njob);
+	free(job);
+	finish(n, nsys, 0);
+}
+
+static void
+hashfile(struct node *n, char *buf)
+{
+	blake3_hasher ctx;
+	char *name;
+	ssize_t ret;
+	unsigned long long nsys = 2, nhashed = 0;
+	int fd;
+
+	name = nodepath(n);
+	fd = openat(rootfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		fatal("open %s/%s:", prefix, name);
+	blake3_hasher_init(&ctx);
+	while (++nsys, (ret = read(fd, buf, DIRBUF)) > 0) {
+		blake3_hasher_update(&ctx, buf, ret);
+		nhashed += ret;
+	}
+	if (ret < 0)
+		fatal("read %s/%s:", prefix, name);
+	close(fd);
+	free(name);
+	blake3_hasher_finalize(&ctx, n->hash, sizeof(n->hash));
+	finish(n, nsys, nhashed);
+}
+
+static void *
+worker(void *arg)
+{
+	struct queue *q = arg;
+	struct node *n;
+	char *buf, *name = NULL;
+	long long start = 0;
+	int phase = 0;
+
+	buf = malloc(DIRBUF);
+	if (!buf)
+		fatal(NULL);
+	for (;;) {
+		n = take(q, 0);
+		if (!n)
+			n = steal(q);
+		if (!n) {
+			pthread_mutex_lock(&pool.lock);
+			++pool.sleeping;
+			while (!(n = steal(q)))
+				pthread_cond_wait(&pool.work, &pool.lock);
+			--pool.sleeping;
+			pthread_mutex_unlock(&pool.lock);
+		}
+		/* the output may free the node as soon as it is done */
+		if (tracing) {
+			name = nodepath(n);
+			phase = S_ISDIR(n->mode) ? PHASESCANDIR : PHASEHASH;
+			start = tracenow();
+		}
+		if (S_ISDIR(n->mode))
+			listdir(n, q, buf);
+		else
+			hashfile(n, buf);
+		if (tracing) {
+			tracespan(phase, name, start, tracenow());
+			free(name);
+		}
+	}
+	return NULL;
+}
+
+static void
+recadd(size_t *len, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(rec + *len, recmax - *len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			fatal("vsnprintf:");
+		if (*len + n < recmax)
+			break;
+		recmax = *len + n + 1 > recmax * 2 ? *len + n + 1 : recmax * 2;
+		rec = realloc(rec, recmax);
+		if (!rec)
+			fatal(NULL);
+	}
+	*len += n;
+}
+
+/* pass the record of a node and then of its children to the next stage, waiting for the workers as needed */
+static void
+emit(struct stage *s, struct node *n)
+{
+	static const char hex[] = "0123456789abcdef";
+	char hash[2 * BLAKE3_OUT_LEN + 1];
+	size_t len, oldlen, i;
+	int phase;
+
+	pthread_mutex_lock(&pool.lock);
+	if (!n->done) {
+		phase = statphase(S_ISDIR(n->mode) ? PHASESCANDIR : PHASEHASH);
+		pool.wait = n;
+		while (!n->done)
+			pthread_cond_wait(&pool.done, &pool.lock);
+		pool.wait = NULL;
+		statphase(phase);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	len = 0;
+	recadd(&len, "%s\n", pathlen ? path : "/");
+	switch (n->mode & S_IFMT) {
+	case S_IFDIR:
+		recadd(&len, "type=dir\nmode=%04o\n", (unsigned)(n->mode & 07777));
+		break;
+	case S_IFREG:
+		recadd(&len, "type=reg\nmode=%04o\nsize=%lld\nsource=%s%s\n", (unsigned)(n->mode & 07777), (long long)n->size, prefix, path);
+		if (hflag) {
+			for (i = 0; i < sizeof(n->hash); ++i) {
+				hash[2 * i] = hex[n->hash[i] >> 4];
+				hash[2 * i + 1] = hex[n->hash[i] & 0xf];
+			}
+			hash[2 * i] = '\0';
+			recadd(&len, "blake3=%s\n", hash);
+		}
+		break;
+	case S_IFLNK:
+		recadd(&len, "type=sym\ntarget=%s\n", n->target);
+		break;
+	}
+	++stats[STATRECORDS];
+	s->record(s, rec, len);
+
+	oldlen = pathlen;
+	for (i = 0; i < n->nchild; ++i) {
+		len = strlen(n->child[i]->name);
+		if (oldlen + len + 2 > pathmax) {
+			pathmax = oldlen + len + 2 > pathmax * 2 ? oldlen + len + 2 : pathmax * 2;
+			path = realloc(path, pathmax);
+			if (!path)
+				fatal(NULL);
+		}
+		path[oldlen] = '/';
+		memcpy(path + oldlen + 1, n->child[i]->name, len + 1);
+		pathlen = oldlen + 1 + len;
+		emit(s, n->child[i]);
+		free(n->child[i]->target);
+		free(n->child[i]->child);
+		free(n->child[i]);
+	}
+	pathlen = oldlen;
+	if (path)
+		path[pathlen] = '\0';
+}
+
+/* walk the tree at dir with a pool of threads, passing its records to a stage in manifest order */
+void
+scanfeed(struct stage *s, const char *dir, const struct scanopt *opt)
+{
+	struct statx stx;
+	struct node *root;
+	pthread_t tid;
+	long i;
+
+	hflag = opt->hash;
+	for (prefixlen = strlen(dir); prefixlen > 0 && dir[prefixlen - 1] == '/'; --prefixlen)
+		;
+	prefix = strndup(dir, prefixlen);
+	if (!prefix)
+		fatal(NULL);
+	stats[STATSYSCALLS] += 2;
+	rootfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (rootfd < 0 || statx(rootfd, "", AT_EMPTY_PATH, STATX_TYPE | STATX_MODE, &stx) != 0)
+		fatal("open %s:", dir);
+	root = mknode(NULL, "");
+	root->mode = stx.stx_mode;
+
+	nqueues = opt->threads;
+	if (nqueues <= 0)
+		nqueues = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nqueues <= 0)
+		nqueues = 1;
+	queues = calloc(nqueues, sizeof(queues[0]));
+	if (!queues)
+		fatal(NULL);
+	for (i = 0; i < nqueues; ++i)
+		pthread_mutex_init(&queues[i].lock, NULL);
+	push(&queues[0], &root, 1);
+	for (i = 0; i < nqueues; ++i) {
+		if (pthread_create(&tid, NULL, worker, &queues[i]) != 0)
+			fatal("pthread_create:");
+	}
+	emit(s, root);
+	free(root->child);
+	free(root);
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+/* the records, each terminated by a NUL, and their offsets in the order they are written */
+static char *buf;
+static size_t buflen, bufmax;
+static size_t *fs;
+static size_t fslen, fsmax;
+static int pflag;
+
+static void
+sortrecord(struct stage *s, char *pos, size_t len)
+{
+	if (buflen + len + 1 > bufmax) {
+		bufmax = buflen + len + 1 > bufmax * 2 ? buflen + len + 1 : bufmax * 2;
+		buf = realloc(buf, bufmax);
+		if (!buf)
+			fatal(NULL);
+	}
+	if (fslen == fsmax) {
+		fsmax = fsmax ? fsmax * 2 : 1024;
+		fs = reallocarray(fs, fsmax, sizeof(fs[0]));
+		if (!fs)
+			fatal(NULL);
+	}
+	fs[fslen++] = buflen;
+	memcpy(buf + buflen, pos, len);
+	buflen += len;
+	buf[buflen++] = '\0';
+}
+
+static int
+cmp(const void *p1, const void *p2)
+{
+	const char *r1 = buf + *(const size_t *)p1, *r2 = buf + *(const size_t *)p2;
+
+	for (; *r1 == *r2 && *r1 != '\n'; ++r1, ++r2)
+		;
+	if (*r1 == *r2)
+		return 0;
+	if (*r1 == '\n')
+		return -1;
+	if (*r2 == '\n')
+		return 1;
+	if (*r1 == '/')
+		return -1;
+	if (*r2 == '/')
+		return 1;
+	return *r1 - *r2;
+}
+
+static void
+sortend(struct stage *s)
+{
+	char *dir = NULL;
+	size_t dirmax = 0, len;
+	int phase;
+
+	phase = statphase(PHASESORT);
+	stats[STATSORTBYTES] = bufmax + fsmax * sizeof(fs[0]);
+	qsort(fs, fslen, sizeof(fs[0]), cmp);
+	statphase(PHASEWRITE);
+	for (size_t i = 0; i < fslen; ++i) {
+		char *r = buf + fs[i], *p = r, *q;
+
+		if (pflag) {
+			if (i) {
+				q = buf + fs[i - 1];
+				while (*p++ == *q++)
+					;
+			}
+			for (; p[1] != '\n'; ++p) {
+				if (*p != '/')
+					continue;
+				len = p - r + (p == r);
+				if (dirmax < len + 22) {
+					dirmax = len + 22;
+					dir = realloc(dir, dirmax);
+					if (!dir)
+						fatal(NULL);
+				}
+				memcpy(dir, r, len);
+				memcpy(dir + len, "\ntype=dir\nmode=0755\n", 20);
+				s->next->record(s->next, dir, len + 20);
+			}
+		}
+		s->next->record(s->next, r, strlen(r));
+	}
+	free(dir);
+	statphase(phase);
+	s->next->end(s->next);
+}
+
+/* a filter that sorts the records by path; with pflag, missing parent directories are added */
+struct stage *
+sortstage(int flag, struct stage *next)
+{
+	static struct stage s = {sortrecord, sortend};
+
+	pflag = flag;
+	s.next = next;
+	return &s;
+}
@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include "common.h"
+
+static struct stage *head;
+
+static void
+feedrecord(char *pos, size_t len)
+{
+	head->record(head, pos, len);
+}
+
+/* parse a manifest into the first stage of a pipeline */
+void
+stagefeed(struct stage *s, FILE *file)
+{
+	struct stage *old;
+
+	old = head;
+	head = s;
+	parse(file, feedrecord);
+	head = old;
+}
+
+static void
+writerecord(struct stage *s, char *pos, size_t len)
+{
+	fwrite(pos, 1, len, stdout);
+	fputc('\n', stdout);
+}
+
+static void
+writeend(struct stage *s)
+{
+	statphase(PHASEWRITE);
+	fflush(stdout);
+	if (ferror(stdout))
+		fatal("write:");
+}
+
+/* a sink that writes the records to stdout as a manifest */
+struct stage *
+writestage(void)
+{
+	static struct stage s = {writerecord, writeend};
+
+	return &s;
+}
@@ -0,0 +1,106 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+
+unsigned long long stats[NSTATS];
+
+static const char *statnames[] = {
+	[STATRECORDS]    = "records",
+	[STATHASHED]     = "bytes_hashed",
+	[STATCOPIED]     = "bytes_copied",
+	[STATUNCHANGED]  = "unchanged",
+	[STATDELETED]    = "deleted",
+	[STATSYSCALLS]   = "syscalls",
+	[STATMISMATCHED] = "mismatched",
+	[STATSORTBYTES]  = "sort_bytes",
+};
+
+const char *const phasenames[NPHASES] = {
+	[PHASEOTHER]    = "other",
+	[PHASEPARSE]    = "parse",
+	[PHASESTAT]     = "stat",
+	[PHASESCANDIR]  = "scandir",
+	[PHASEPREFETCH] = "prefetch",
+	[PHASEHASH]     = "hash",
+	[PHASEFETCH]    = "fetch",
+	[PHASERENAME]   = "rename",
+	[PHASEDELETE]   = "delete",
+	[PHASESORT]     = "sort",
+	[PHASEHEADER]   = "header",
+	[PHASEWRITE]    = "write",
+};
+
+static FILE *statsfile;
+static int phase;
+static long long wall[NPHASES], cpu[NPHASES], lastwall, lastcpu, startwall;
+
+static long long
+now(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void
+statsinit(const char *name)
+{
+	if (strcmp(name, "-") == 0) {
+		statsfile = stderr;
+	} else {
+		statsfile = fopen(name, "w");
+		if (!statsfile)
+			fatal("open %s:", name);
+	}
+	startwall = lastwall = now(CLOCK_MONOTONIC);
+	lastcpu = now(CLOCK_THREAD_CPUTIME_ID);
+}
+
+int
+statphase(int next)
+{
+	long long t;
+	int prev;
+
+	prev = phase;
+	if ((statsfile || tracing) && next != prev) {
+		t = now(CLOCK_MONOTONIC);
+		if (tracing)
+			tracephase(prev, lastwall, t);
+		wall[prev] += t - lastwall;
+		lastwall = t;
+	}
+	if (statsfile && next != prev) {
+		t = now(CLOCK_THREAD_CPUTIME_ID);
+		cpu[prev] += t - lastcpu;
+		lastcpu = t;
+	}
+	phase = next;
+	return prev;
+}
+
+void
+statsprint(void)
+{
+	int i;
+
+	if (!statsfile)
+		return;
+	statphase(PHASEOTHER);
+	for (i = 0; i < NSTATS; ++i)
+		fprintf(statsfile, "%s %llu\n", statnames[i], stats[i]);
+	for (i = 0; i < NPHASES; ++i) {
+		if (wall[i] == 0 && cpu[i] == 0)
+			continue;
+		fprintf(statsfile, "time.%s.wall %.6f\n", phasenames[i], wall[i] / 1e9);
+		fprintf(statsfile, "time.%s.cpu %.6f\n", phasenames[i], cpu[i] / 1e9);
+	}
+	fprintf(statsfile, "time.total.wall %.6f\n", (now(CLOCK_MONOTONIC) - startwall) / 1e9);
+	fprintf(statsfile, "time.total.cpu %.6f\n", now(CLOCK_PROCESS_CPUTIME_ID) / 1e9);
+	fflush(statsfile);
+	if (ferror(statsfile))
+		fatal("write stats:");
+}
@@ -0,0 +1,2167 @@
+#define _GNU_SOURCE /* for O_PATH, struct dirent64 */
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <ftw.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <blake3.h>
+#include "common.h"
+
+static char *root;
+static char *path;
+static size_t baselen, pathlen, pathmax;
+static struct dir *dir;
+static char *stage; /* with -x, the sibling directory the new tree is built in */
+static char *swapname; /* with -x, the root with its parent resolved, to swap with the stage */
+static int building;
+static int dflag, xflag, rootfd = -1, fetchdir = AT_FDCWD;
+
+enum {
+	DIRBUF = 65536,
+	RMTHREADS = 4,
+	RENAMEBATCH = 256,
+	AHEAD = 64,
+	AHEADBUF = 262144,
+};
+
+enum {
+	RMROOT = 1 << 0,  /* remove the directory itself, not only its contents */
+	RMQUIET = 1 << 1, /* remove even with -x, and print nothing */
+};
+
+enum {
+	AHEADNONE,
+	AHEADSTAT,
+	AHEADOPEN,
+	AHEADREAD,
+	AHEADSTATED,
+	AHEADHASHED,
+};
+
+struct entry {
+	uint64_t key, ino;
+	size_t name;
+	unsigned char type;
+};
+
+struct dir {
+	int fd, wfd, complete;
+	char *names;
+	struct entry *ent;
+	size_t pos, len, pathlen;
+	long state;
+	struct dir *next;
+};
+
+struct node {
+	struct node *parent, *child, *next, *qnext;
+	mode_t mode;
+	off_t size;
+	int fd;
+	size_t pending;
+	char name[];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	struct node *queue;
+	int started, finished, dirfd, removeroot, dry;
+} rm = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+/* a record in the lookahead window, with its prefetched metadata and hash */
+struct ahead {
+	size_t rec, reclen, name;
+	int state, reg, fd;
+	struct statx stx;
+	blake3_hasher ctx;
+	char *buf;
+	off_t off;
+	unsigned char hash[BLAKE3_OUT_LEN];
+};
+
+/* a fetched file waiting for its data to reach the disk before it is renamed into place */
+struct rename {
+	int fd, dirfd, rmdir;
+	char tmp[8];
+	char *name;
+};
+
+/* the archive member whose data is next in the -t stream */
+struct tarmember {
+	char *name;
+	size_t namemax;
+	off_t size, left, realsize;
+	int named, sparse;
+};
+
+/* a directory as a previous run left it, with the tree digest it was synced to */
+struct state {
+	char *path;
+	unsigned char tree[BLAKE3_OUT_LEN];
+	ino_t ino;
+	struct timespec mtime, ctime;
+	int valid;
+};
+
+struct fetcher {
+	pid_t pid;
+	int rfd, wfd;
+};
+
+static struct uring *ring;
+static struct ahead ahead[AHEAD], *cur;
+static size_t naheads;
+static char *win;
+static size_t winlen, winmax;
+static int aheadfd = -1;
+static int durability = DURABLENONE;
+static struct rename renames[RENAMEBATCH];
+static size_t nrenames;
+static int tarfd = -1, tarseek;
+static struct tarmember member;
+static char *statefile, *skip;
+static size_t skiplen;
+static struct state *state, *newstate;
+static size_t nstate, nnewstate, newstatemax;
+static struct timespec statetime;
+
+/* set path to the entry name under the directory ending at len */
+static void
+pathadd(size_t len, const char *name)
+{
+	size_t namelen;
+
+	namelen = strlen(name);
+	if (len + namelen + 2 > pathmax) {
+		pathmax = len + namelen + 2 > pathmax * 2 ? len + namelen + 2 : pathmax * 2;
+		path = realloc(path, pathmax);
+		if (!path)
+			fatal(NULL);
+	}
+	path[len] = '/';
+	memcpy(path + len + 1, name, namelen + 1);
+	pathlen = len + 1 + namelen;
+}
+
+static uint64_t
+entkey(const char *name)
+{
+	uint64_t key;
+	int i;
+
+	/* order matches pathcmp, where '\0' sorts first and other bytes compare as char */
+	key = 0;
+	for (i = 0; i < 8; ++i) {
+		key <<= 8;
+		if (*name)
+			key |= (unsigned char)*name++ ^ (CHAR_MIN < 0 ? 0x80 : 0);
+	}
+	return key;
+}
+
+static int
+entcmp(const void *p1, const void *p2)
+{
+	const struct entry *e1 = p1, *e2 = p2;
+
+	if (e1->key != e2->key)
+		return e1->key < e2->key ? -1 : 1;
+	return pathcmp(dir->names + e1->name, dir->names + e2->name, NULL);
+}
+
+static void
+dirpush(int fd, int scan)
+{
+	struct dir *d;
+	struct dirent64 *ent;
+	size_t namemax, entmax, used, off;
+	ssize_t ret;
+	int dfd, phase;
+
+	d = malloc(sizeof(*d));
+	if (!d)
+		fatal(NULL);
+	d->fd = fd;
+	d->wfd = fd;
+	d->names = NULL;
+	d->ent = NULL;
+	d->pos = 0;
+	d->len = 0;
+	d->complete = fd == -1 || scan >= 0;
+	d->next = dir;
+	dir = d;
+	if (scan > 0) {
+		/* read whole getdents64 batches into one arena and index the records in place */
+		phase = statphase(PHASESCANDIR);
+		++stats[STATSYSCALLS];
+		dfd = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dfd < 0)
+			fatal("open %s:", path);
+		namemax = 0;
+		entmax = 0;
+		used = 0;
+		for (;;) {
+			if (namemax - used < DIRBUF) {
+				namemax = namemax ? namemax * 2 : DIRBUF * 2;
+				d->names = realloc(d->names, namemax);
+				if (!d->names)
+					fatal(NULL);
+			}
+			++stats[STATSYSCALLS];
+			ret = syscall(SYS_getdents64, dfd, d->names + used, namemax - used);
+			if (ret < 0)
+				fatal("getdents %s:", path);
+			if (ret == 0)
+				break;
+			for (off = used, used += ret; off < used; off += ent->d_reclen) {
+				const char *n;
+
+				ent = (struct dirent64 *)(d->names + off);
+				n = ent->d_name;
+				if (n[0] == '.' && (!n[1] || (n[1] == '.' && !n[2])))
+					continue;
+				if (d->len == entmax) {
+					entmax = entmax ? entmax * 2 : 64;
+					d->ent = reallocarray(d->ent, entmax, sizeof(d->ent[0]));
+					if (!d->ent)
+						fatal(NULL);
+				}
+				d->ent[d->len].key = entkey(n);
+				d->ent[d->len].name = n - d->names;
+				d->ent[d->len].ino = ent->d_ino;
+				d->ent[d->len].type = ent->d_type;
+				++d->len;
+			}
+		}
+		++stats[STATSYSCALLS];
+		close(dfd);
+		qsort(d->ent, d->len, sizeof(d->ent[0]), entcmp);
+		statphase(phase);
+	}
+
+	d->pathlen = pathlen;
+	d->state = -1;
+}
+
+static void delete(int, const char *, int);
+static void flushrenames(void);
+
+/* delete the remaining entries of the innermost directory and close it */
+static void
+dirpop(void)
+{
+	struct dir *d;
+
+	flushrenames();
+	d = dir;
+	for (; d->pos < d->len; ++d->pos) {
+		pathadd(d->pathlen, d->names + d->ent[d->pos].name);
+		delete(d->fd, d->names + d->ent[d->pos].name, d->ent[d->pos].type);
+	}
+	if (d->state != -1) {
+		struct stat st;
+
+		/* the directory is final now, so these are the times a later run compares */
+		++stats[STATSYSCALLS];
+		if (fstat(d->fd, &st) == 0) {
+			newstate[d->state].ino = st.st_ino;
+			newstate[d->state].mtime = st.st_mtim;
+			newstate[d->state].ctime = st.st_ctim;
+			newstate[d->state].valid = 1;
+		}
+	}
+	free(d->names);
+	free(d->ent);
+	if (d->fd >= 0) {
+		++stats[STATSYSCALLS];
+		close(d->fd);
+	}
+	if (d->wfd >= 0 && d->wfd != d->fd) {
+		++stats[STATSYSCALLS];
+		close(d->wfd);
+	}
+	dir = d->next;
+	free(d);
+}
+
+/* whether the innermost directory contains name; path must still begin with the directory */
+static int
+dirhas(const char *name)
+{
+	size_t len;
+
+	len = dir->pathlen - baselen;
+	return memcmp(path + baselen, name, len) == 0 && name[len] == '/';
+}
+
+static int
+hexval(int c)
+{
+	if ('0' <= c && c <= '9')
+		return c - '0';
+	switch (c) {
+	case 'a': case 'A': return 10;
+	case 'b': case 'B': return 11;
+	case 'c': case 'C': return 12;
+	case 'd': case 'D': return 13;
+	case 'e': case 'E': return 14;
+	case 'f': case 'F': return 15;
+	}
+	return -1;
+}
+
+static int
+hexdec(unsigned char *dst, const char *src, size_t len)
+{
+	int x1, x2;
+
+	for (; len > 0; --len) {
+		x1 = hexval(*src++);
+		x2 = hexval(*src++);
+		if (x1 == -1 || x2 == -1)
+			return -1;
+		*dst++ = x1 << 4 | x2;
+	}
+	return 0;
+}
+
+static void *
+grow(void *p, size_t *max, size_t need, size_t size)
+{
+	if (need <= *max)
+		return p;
+	*max = need > *max * 2 ? need : *max * 2;
+	p = reallocarray(p, *max, size);
+	if (!p)
+		fatal(NULL);
+	return p;
+}
+
+static void
+stateload(void)
+{
+	char *buf, *line, *end;
+	size_t len, max;
+	struct state *e;
+	FILE *file;
+
+	file = fopen(statefile, "r");
+	if (!file) {
+		if (errno != ENOENT)
+			fatal("open %s:", statefile);
+		return;
+	}
+	buf = NULL;
+	len = 0;
+	max = 0;
+	do {
+		if (max - len < 65536) {
+			max = max ? max * 2 : 65536;
+			buf = realloc(buf, max + 1);
+			if (!buf)
+				fatal(NULL);
+		}
+		len += fread(buf + len, 1, max - len, file);
+	} while (!feof(file) && !ferror(file));
+	if (ferror(file))
+		fatal("read %s:", statefile);
+	fclose(file);
+	buf[len] = '\0';
+
+	/* the first line is when the state was written, then one line per directory */
+	statetime.tv_sec = strtoll(buf, &end, 10);
+	statetime.tv_nsec = *end == '.' ? strtol(end + 1, &end, 10) : 0;
+	if (*end != '\n')
+		fatal("invalid state file %s", statefile);
+	max = 0;
+	for (line = end + 1; *line; line = end + 1) {
+		end = strchr(line, '\n');
+		if (!end)
+			fatal("invalid state file %s", statefile);
+		*end = '\0';
+		state = grow(state, &max, nstate + 1, sizeof(state[0]));
+		e = &state[nstate++];
+		if (end - line < 2 * BLAKE3_OUT_LEN + 1 || hexdec(e->tree, line, BLAKE3_OUT_LEN) != 0)
+			fatal("invalid state file %s", statefile);
+		line += 2 * BLAKE3_OUT_LEN;
+		e->ino = strtoull(line, &line, 10);
+		e->mtime.tv_sec = strtoll(line, &line, 10);
+		e->mtime.tv_nsec = *line == '.' ? strtol(line + 1, &line, 10) : 0;
+		e->ctime.tv_sec = strtoll(line, &line, 10);
+		e->ctime.tv_nsec = *line == '.' ? strtol(line + 1, &line, 10) : 0;
+		if (*line != ' ' || line[1] != '/')
+			fatal("invalid state file %s", statefile);
+		e->path = line + 1;
+		e->valid = 1;
+	}
+}
+
+/* the entry for the directory at rel (its path without the leading slash), or -1 */
+static long
+statefind(const char *rel)
+{
+	size_t lo = 0, hi = nstate, mid;
+	int ret;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		ret = pathcmp(state[mid].path + 1, rel, NULL);
+		if (ret == 0)
+			return mid;
+		if (ret < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -1;
+}
+
+static int
+timeeq(const struct timespec *t1, const struct timespec *t2)
+{
+	return t1->tv_sec == t2->tv_sec && t1->tv_nsec == t2->tv_nsec;
+}
+
+/* whether t is too close to when the state was written for a later change to show */
+static int
+timeracy(const struct timespec *t)
+{
+	return t->tv_sec >= statetime.tv_sec - 2;
+}
+
+/*
+ * if every directory in the subtree at state entry i is as recorded, return
+ * the end of the subtree's entries, and 0 otherwise; a change to a directory
+ * entry anywhere below updates the mtime of the directory holding it
+ */
+static size_t
+statecheck(size_t i)
+{
+	struct state *e;
+	struct stat st;
+	char *full = NULL;
+	size_t len, fullmax = 0, n;
+
+	len = strlen(state[i].path);
+	for (n = i; n < nstate; ++n) {
+		e = &state[n];
+		if (n > i && (strncmp(e->path, state[i].path, len) != 0 || (len > 1 && e->path[len] != '/')))
+			break;
+		full = grow(full, &fullmax, baselen + strlen(e->path) + 1, 1);
+		memcpy(full, root, baselen);
+		strcpy(full + baselen, e->path);
+		++stats[STATSYSCALLS];
+		if (!e->valid || fstatat(AT_FDCWD, full, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISDIR(st.st_mode)
+		 || st.st_ino != e->ino || !timeeq(&st.st_mtim, &e->mtime) || !timeeq(&st.st_ctim, &e->ctime)
+		 || timeracy(&e->mtime) || timeracy(&e->ctime)) {
+			free(full);
+			return 0;
+		}
+	}
+	free(full);
+	return n;
+}
+
+static long
+stateadd(const struct state *e)
+{
+	newstate = grow(newstate, &newstatemax, nnewstate + 1, sizeof(newstate[0]));
+	newstate[nnewstate] = *e;
+	return nnewstate++;
+}
+
+static void
+statewrite(void)
+{
+	static const char hex[] = "0123456789abcdef";
+	struct state *e;
+	struct timespec now;
+	char *tmp;
+	size_t i;
+	FILE *file;
+	int fd;
+
+	tmp = malloc(strlen(statefile) + 8);
+	if (!tmp)
+		fatal(NULL);
+	sprintf(tmp, "%s.XXXXXX", statefile);
+	fd = mkstemp(tmp);
+	if (fd < 0 || !(file = fdopen(fd, "w")))
+		fatal("open %s:", tmp);
+	clock_gettime(CLOCK_REALTIME, &now);
+	fprintf(file, "%lld.%09ld\n", (long long)now.tv_sec, now.tv_nsec);
+	for (e = newstate; e < newstate + nnewstate; ++e) {
+		if (!e->valid)
+			continue;
+		for (i = 0; i < sizeof(e->tree); ++i) {
+			fputc(hex[e->tree[i] >> 4], file);
+			fputc(hex[e->tree[i] & 0xf], file);
+		}
+		fprintf(file, " %ju %lld.%09ld %lld.%09ld %s\n", (uintmax_t)e->ino,
+			(long long)e->mtime.tv_sec, e->mtime.tv_nsec, (long long)e->ctime.tv_sec, e->ctime.tv_nsec, e->path);
+	}
+	fflush(file);
+	if (ferror(file) || (durability != DURABLENONE && fsync(fd) != 0))
+		fatal("write %s:", tmp);
+	fclose(file);
+	if (rename(tmp, statefile) != 0)
+		fatal("rename %s:", tmp);
+	free(tmp);
+}
+
+static void
+randname(char *template)
+{
+	int i;
+	struct timespec ts;
+	unsigned long f;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	f = ts.tv_nsec * 0x10001 ^ ((uintptr_t)&ts / 16 + (uintptr_t)template);
+	for (i = 0; i < 6; ++i, f >>= 5)
+		template[i] = 'A' + (f & 15) + (f & 16) * 2;
+}
+
+static int
+tmpcreate(char tmp[static 8], const char *target)
+{
+	int retry, fd;
+
+	if (rootfd < 0)
+		fatal("open %s:", root);
+	memcpy(tmp, ".XXXXXX", 8);
+	for (retry = 20; retry > 0; --retry) {
+		randname(tmp + 1);
+		++stats[STATSYSCALLS];
+		if (target) {
+			if (symlinkat(target, rootfd, tmp) == 0)
+				return -1;
+		} else {
+			fd = openat(rootfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+			if (fd >= 0)
+				return fd;
+		}
+		if (errno != EEXIST)
+			fatal("%s %s/%s:", target ? "symlink" : "open", root, tmp);
+	}
+	fatal("could not find temporary name");
+	return -1;
+}
+
+static void
+tarread(void *buf, size_t len)
+{
+	char *pos;
+	ssize_t ret;
+
+	for (pos = buf; len > 0; pos += ret, len -= ret) {
+		++stats[STATSYSCALLS];
+		ret = read(tarfd, pos, len);
+		if (ret < 0)
+			fatal("read archive:");
+		if (ret == 0)
+			fatal("archive is truncated");
+	}
+}
+
+/* pass over data without buffering it, by seeking when the archive is a regular file */
+static void
+tarskip(off_t len)
+{
+	char buf[16384];
+	size_t n;
+
+	if (len == 0)
+		return;
+	if (tarseek) {
+		++stats[STATSYSCALLS];
+		if (lseek(tarfd, len, SEEK_CUR) != -1)
+			return;
+	}
+	for (; len > 0; len -= n) {
+		n = len < sizeof(buf) ? len : sizeof(buf);
+		tarread(buf, n);
+	}
+}
+
+/* read a piped archive to its end, so the writer is not killed by SIGPIPE */
+static void
+tardrain(void)
+{
+	char buf[16384];
+	ssize_t ret;
+
+	if (tarseek)
+		return;
+	do {
+		++stats[STATSYSCALLS];
+		ret = read(tarfd, buf, sizeof(buf));
+	} while (ret > 0);
+	if (ret < 0)
+		fatal("read archive:");
+}
+
+static off_t
+taroct(const char *s, size_t len)
+{
+	off_t n = 0;
+
+	for (; len > 0 && *s == ' '; ++s, --len)
+		;
+	for (; len > 0 && *s >= '0' && *s <= '7'; ++s, --len)
+		n = n * 8 + *s - '0';
+	return n;
+}
+
+/* name the member like a manifest path; ./x and x are taken as /x */
+static void
+tarsetname(const char *name, size_t len)
+{
+	size_t i = 0;
+
+	if (member.namemax < len + 2) {
+		member.namemax = len + 2;
+		member.name = realloc(member.name, member.namemax);
+		if (!member.name)
+			fatal(NULL);
+	}
+	if (len > 0 && name[0] == '.' && (len == 1 || name[1] == '/'))
+		++name, --len;
+	if (len == 0 || name[0] != '/')
+		member.name[i++] = '/';
+	memcpy(member.name + i, name, len);
+	i += len;
+	while (i > 1 && member.name[i - 1] == '/')
+		--i;
+	member.name[i] = '\0';
+	member.named = 1;
+}
+
+static void
+tarreset(void)
+{
+	member.named = 0;
+	member.size = -1;
+	member.realsize = -1;
+	member.sparse = 0;
+}
+
+/* apply the records of a pax extended header to the next member */
+static void
+tarpax(char *pos, size_t len)
+{
+	char *key, *val, *end;
+	unsigned long n;
+
+	while (len > 0) {
+		n = strtoul(pos, &key, 10);
+		if (n == 0 || n > len || *key != ' ' || pos[n - 1] != '\n')
+			fatal("invalid pax header");
+		end = pos + n - 1;
+		++key;
+		val = memchr(key, '=', end - key);
+		if (!val)
+			fatal("invalid pax header");
+		*val++ = '\0';
+		if (strcmp(key, "path") == 0 || strcmp(key, "GNU.sparse.name") == 0)
+			tarsetname(val, end - val);
+		else if (strcmp(key, "size") == 0)
+			member.size = strtoll(val, NULL, 10);
+		else if (strcmp(key, "GNU.sparse.realsize") == 0)
+			member.realsize = strtoll(val, NULL, 10);
+		else if (strcmp(key, "GNU.sparse.major") == 0)
+			member.sparse = strtol(val, NULL, 10) == 1;
+		pos += n;
+		len -= n;
+	}
+}
+
+/* advance the archive to the regular file member called name; members are in manifest order */
+static void
+tarnext(const char *name)
+{
+	char hdr[512], raw[257], *pax;
+	unsigned long chksum;
+	off_t size;
+	int i;
+
+	tarreset();
+	for (;;) {
+		tarread(hdr, 512);
+		if (hdr[0] == '\0')
+			fatal("file '%s' is missing from archive", name);
+		chksum = 0;
+		for (i = 0; i < 512; ++i)
+			chksum += i >= 148 && i < 156 ? ' ' : (unsigned char)hdr[i];
+		if (chksum != taroct(hdr + 148, 8))
+			fatal("invalid archive header checksum");
+		size = taroct(hdr + 124, 12);
+		if (hdr[156] == 'x' || hdr[156] == 'g') {
+			pax = malloc(size + 1);
+			if (!pax)
+				fatal(NULL);
+			tarread(pax, size);
+			pax[size] = '\0';
+			tarskip(-size & 511);
+			if (hdr[156] == 'x')
+				tarpax(pax, size);
+			free(pax);
+			continue;
+		}
+		if (!member.named) {
+			if (hdr[345])
+				snprintf(raw, sizeof(raw), "%.*s/%.*s", (int)strnlen(hdr + 345, 155), hdr + 345, (int)strnlen(hdr, 100), hdr);
+			else
+				snprintf(raw, sizeof(raw), "%.*s", (int)strnlen(hdr, 100), hdr);
+			tarsetname(raw, strlen(raw));
+		}
+		if (member.size < 0)
+			member.size = size;
+		member.left = member.size;
+		if ((hdr[156] == '0' || hdr[156] == '\0') && strcmp(member.name, name) == 0)
+			return;
+		if (pathcmp(member.name, name, NULL) > 0)
+			fatal("file '%s' is missing from archive", name);
+		tarskip(member.size + (-member.size & 511));
+		tarreset();
+	}
+}
+
+static void
+tarcopy(int dstfd, const char *tmp, blake3_hasher *ctx, off_t len)
+{
+	char buf[65536], *pos;
+	size_t n, left;
+	ssize_t ret;
+
+	if (len > member.left)
+		fatal("file '%s' has invalid sparse map", member.name);
+	member.left -= len;
+	for (; len > 0; len -= n) {
+		n = len < sizeof(buf) ? len : sizeof(buf);
+		tarread(buf, n);
+		blake3_hasher_update(ctx, buf, n);
+		stats[STATHASHED] += n;
+		stats[STATCOPIED] += n;
+		for (left = n, pos = buf; left > 0; left -= ret, pos += ret) {
+			++stats[STATSYSCALLS];
+			ret = write(dstfd, pos, left);
+			if (ret <= 0)
+				fatal("write %s/%s:", root, tmp);
+		}
+	}
+}
+
+static void
+hashzeros(blake3_hasher *ctx, off_t len)
+{
+	static const char zero[65536];
+	size_t n;
+
+	for (; len > 0; len -= n) {
+		n = len < sizeof(zero) ? len : sizeof(zero);
+		blake3_hasher_update(ctx, zero, n);
+		stats[STATHASHED] += n;
+	}
+}
+
+/* copy a GNU sparse 1.0 member: a block-padded map of extents, followed by their data */
+static off_t
+tarsparse(int dstfd, const char *tmp, blake3_hasher *ctx)
+{
+	char block[512];
+	off_t *num = NULL, pos, val;
+	size_t nnum = 0, want = 1, max = 0, i;
+	int digits = 0;
+
+	val = 0;
+	while (nnum < want) {
+		if (member.left < 512)
+			fatal("file '%s' has invalid sparse map", member.name);
+		tarread(block, 512);
+		member.left -= 512;
+		for (i = 0; i < 512 && nnum < want; ++i) {
+			if (block[i] >= '0' && block[i] <= '9') {
+				val = val * 10 + block[i] - '0';
+				digits = 1;
+				continue;
+			}
+			if (block[i] != '\n' || !digits)
+				fatal("file '%s' has invalid sparse map", member.name);
+			if (nnum == max) {
+				max = max ? max * 2 : 16;
+				num = reallocarray(num, max, sizeof(num[0]));
+				if (!num)
+					fatal(NULL);
+			}
+			num[nnum++] = val;
+			if (nnum == 1)
+				want = 1 + 2 * val;
+			val = 0;
+			digits = 0;
+		}
+	}
+	pos = 0;
+	for (i = 1; i < nnum; i += 2) {
+		if (num[i] < pos)
+			fatal("file '%s' has invalid sparse map", member.name);
+		hashzeros(ctx, num[i] - pos);
+		++stats[STATSYSCALLS];
+		if (lseek(dstfd, num[i], SEEK_SET) < 0)
+			fatal("seek %s/%s:", root, tmp);
+		tarcopy(dstfd, tmp, ctx, num[i + 1]);
+		pos = num[i] + num[i + 1];
+	}
+	free(num);
+	if (member.realsize < pos)
+		fatal("file '%s' has invalid sparse map", member.name);
+	hashzeros(ctx, member.realsize - pos);
+	++stats[STATSYSCALLS];
+	if (ftruncate(dstfd, member.realsize) != 0)
+		fatal("truncate %s/%s:", root, tmp);
+	return member.realsize;
+}
+
+/* reserve space for a file that is written whole, so it is laid out contiguously */
+static void
+prealloc(int fd, off_t size)
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+	if (size > 0) {
+		++stats[STATSYSCALLS];
+		fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+	}
+#endif
+}
+
+/* copy and hash the data between off and end at the same offsets */
+static void
+copyrange(int srcfd, const char *src, int dstfd, const char *tmp, blake3_hasher *ctx, off_t off, off_t end)
+{
+	char buf[65536], *pos;
+	size_t len;
+	ssize_t ret, n;
+
+	while (off < end) {
+		++stats[STATSYSCALLS];
+		n = pread(srcfd, buf, end - off < sizeof(buf) ? end - off : sizeof(buf), off);
+		if (n < 0)
+			fatal("read %s:", src);
+		if (n == 0)
+			break;
+		blake3_hasher_update(ctx, buf, n);
+		stats[STATHASHED] += n;
+		stats[STATCOPIED] += n;
+		for (len = n, pos = buf; len > 0; len -= ret, pos += ret, off += ret) {
+			++stats[STATSYSCALLS];
+			ret = pwrite(dstfd, pos, len, off);
+			if (ret <= 0)
+				fatal("write %s/%s:", root, tmp);
+		}
+	}
+}
+
+/*
+ * copy a regular file, leaving its holes as holes in the copy; the holes are
+ * hashed as the zeros they read as, so the digest is of the logical content
+ */
+static off_t
+copysparse(int srcfd, const char *src, off_t size, int dstfd, const char *tmp, blake3_hasher *ctx, off_t hint)
+{
+	off_t off, data, hole;
+
+	for (off = 0; off < size; off = hole) {
+		++stats[STATSYSCALLS];
+		data = lseek(srcfd, off, SEEK_DATA);
+		if (data < 0) {
+			if (errno != ENXIO)
+				fatal("seek %s:", src);
+			data = size;
+		}
+		hole = data < size ? (++stats[STATSYSCALLS], lseek(srcfd, data, SEEK_HOLE)) : size;
+		if (hole < 0)
+			fatal("seek %s:", src);
+		if (hole > size)
+			hole = size;
+		if (off == 0 && data == 0 && hole == size)
+			prealloc(dstfd, hint > 0 ? hint : size);
+		hashzeros(ctx, data - off);
+		copyrange(srcfd, src, dstfd, tmp, ctx, data, hole);
+	}
+	++stats[STATSYSCALLS];
+	if (ftruncate(dstfd, size) != 0)
+		fatal("truncate %s/%s:", root, tmp);
+	return size;
+}
+
+/* close a written temporary, or with -S batch pass it on to be waited for before its rename */
+static void
+tmpdone(const char *tmp, int fd, int *fdp)
+{
+	*fdp = -1;
+	switch (durability) {
+	case DURABLESTRICT:
+		++stats[STATSYSCALLS];
+		if (fdatasync(fd) != 0)
+			fatal("fsync %s/%s:", root, tmp);
+		break;
+	case DURABLEBATCH:
+		/* start writeback now, and wait for it just before the rename */
+#ifdef SYNC_FILE_RANGE_WRITE
+		++stats[STATSYSCALLS];
+		sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+		*fdp = fd;
+		break;
+	}
+	if (*fdp == -1) {
+		++stats[STATSYSCALLS];
+		close(fd);
+	}
+}
+
+static off_t
+fetch(char tmp[static 8], const char *name, const char *src, off_t hint, unsigned char hash[static BLAKE3_OUT_LEN], int *fdp)
+{
+	blake3_hasher ctx;
+	char buf[8192], *pos;
+	struct stat st;
+	int srcfd, dstfd;
+	size_t len;
+	ssize_t ret;
+	off_t size;
+
+	/* TODO: support fetch over HTTP */
+
+	dstfd = tmpcreate(tmp, NULL);
+	blake3_hasher_init(&ctx);
+	if (tarfd >= 0) {
+		tarnext(name);
+		if (member.sparse) {
+			size = tarsparse(dstfd, tmp, &ctx);
+		} else {
+			size = member.size;
+			prealloc(dstfd, size);
+			tarcopy(dstfd, tmp, &ctx, size);
+		}
+		tarskip(member.left + (-member.size & 511));
+		tarreset();
+	} else {
+		++stats[STATSYSCALLS];
+		srcfd = openat(fetchdir, src, O_RDONLY);
+		if (srcfd < 0)
+			fatal("open %s:", src);
+		++stats[STATSYSCALLS];
+		if (fstat(srcfd, &st) != 0)
+			fatal("stat %s:", src);
+		size = 0;
+		if (S_ISREG(st.st_mode))
+			size = copysparse(srcfd, src, st.st_size, dstfd, tmp, &ctx, hint);
+		else while (++stats[STATSYSCALLS], (ret = read(srcfd, buf, sizeof(buf))) > 0) {
+			size += ret;
+			blake3_hasher_update(&ctx, buf, ret);
+			stats[STATHASHED] += ret;
+			stats[STATCOPIED] += ret;
+			for (len = ret, pos = buf; len > 0; len -= ret, pos += ret) {
+				++stats[STATSYSCALLS];
+				ret = write(dstfd, pos, len);
+				if (ret <= 0)
+					fatal("write %s/%s:", root, tmp);
+			}
+		}
+		++stats[STATSYSCALLS];
+		close(srcfd);
+	}
+	tmpdone(tmp, dstfd, fdp);
+	blake3_hasher_finalize(&ctx, hash, BLAKE3_OUT_LEN);
+	return size;
+}
+
+/* copy a file of the live tree, sharing its blocks where the filesystem can */
+static void
+clonefile(char tmp[static 8], int dirfd, const char *name, int *fdp)
+{
+	blake3_hasher ctx;
+	struct stat st;
+	int srcfd, dstfd, ret = -1;
+
+	dstfd = tmpcreate(tmp, NULL);
+	++stats[STATSYSCALLS];
+	srcfd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (srcfd < 0)
+		fatal("open %s:", path);
+	++stats[STATSYSCALLS];
+	if (fstat(srcfd, &st) != 0)
+		fatal("stat %s:", path);
+#ifdef FICLONE
+	++stats[STATSYSCALLS];
+	ret = ioctl(dstfd, FICLONE, srcfd);
+#endif
+	if (ret != 0) {
+		blake3_hasher_init(&ctx);
+		copysparse(srcfd, path, st.st_size, dstfd, tmp, &ctx, 0);
+	}
+	++stats[STATSYSCALLS];
+	close(srcfd);
+	tmpdone(tmp, dstfd, fdp);
+}
+
+static void
+syncdir(int fd)
+{
+	if (durability == DURABLESTRICT && fd != AT_FDCWD) {
+		++stats[STATSYSCALLS];
+		if (fsync(fd) != 0)
+			fatal("fsync %s:", path);
+	}
+}
+
+/* wait for the data of the queued files, then rename them into place in order */
+static void
+flushrenames(void)
+{
+	struct rename *r;
+	int phase;
+
+	if (nrenames == 0)
+		return;
+	phase = statphase(PHASERENAME);
+	for (r = renames; r < renames + nrenames; ++r) {
+		if (r->fd == -1)
+			continue;
+		++stats[STATSYSCALLS];
+		if (fdatasync(r->fd) != 0)
+			fatal("fsync %s/%s:", root, r->tmp);
+		++stats[STATSYSCALLS];
+		close(r->fd);
+	}
+	for (r = renames; r < renames + nrenames; ++r) {
+		if (r->rmdir) {
+			++stats[STATSYSCALLS];
+			if (unlinkat(r->dirfd, r->name, AT_REMOVEDIR) != 0)
+				fatal("rmdir %s:", r->name);
+		}
+		++stats[STATSYSCALLS];
+		if (renameat(rootfd, r->tmp, r->dirfd, r->name) != 0)
+			fatal("rename:");
+		free(r->name);
+	}
+	nrenames = 0;
+	statphase(phase);
+}
+
+static void
+infostring(char buf[static 19], size_t len, mode_t mode, off_t size)
+{
+	char *pos;
+
+	memset(buf, '-', 10);
+	switch (mode & S_IFMT) {
+	case S_IFREG: buf[0] = '-'; break;
+	case S_IFDIR: buf[0] = 'd'; break;
+	case S_IFLNK: buf[0] = 'l'; break;
+	case S_IFCHR: buf[0] = 'c'; break;
+	case S_IFBLK: buf[0] = 'b'; break;
+	case S_IFSOCK: buf[0] = 's'; break;
+	}
+	if (mode & S_IRUSR) buf[1] = 'r';
+	if (mode & S_IWUSR) buf[2] = 'w';
+	if (mode & S_IXUSR) buf[3] = 'x';
+	if (mode & S_IRGRP) buf[4] = 'r';
+	if (mode & S_IWGRP) buf[5] = 'w';
+	if (mode & S_IXGRP) buf[6] = 'x';
+	if (mode & S_IROTH) buf[7] = 'r';
+	if (mode & S_IWOTH) buf[8] = 'w';
+	if (mode & S_IXOTH) buf[9] = 'x';
+	if (mode & S_ISUID) buf[3] = buf[3] == 'x' ? 's' : 'S';
+	if (mode & S_ISGID) buf[6] = buf[6] == 'x' ? 's' : 'S';
+	if (mode & S_ISVTX) buf[9] = buf[9] == 'x' ? 't' : 'T';
+	buf[10] = '\0';
+	if (S_ISREG(mode)) {
+		off_t s, r = 0, x;
+		char unit[] = "\0KMGT", *u = unit;
+		int i;
+
+		for (s = size; s > 1024 && u[1]; r = s, s /= 1024, ++u)
+			;
+		for (i = 0, x = s; x; x /= 10, ++i)
+			;
+		if (i > 4)
+			return;
+		buf[10] = ' ';
+		pos = buf + 19;
+		*--pos = '\0';
+		if (*u) {
+			*--pos = *u;
+			r = (r % 1024) * 1000 / 1024;
+			while (r > 10)
+				r /= 10;
+			*--pos = '0' + r % 10;
+			*--pos = '.';
+		}
+		do *--pos = '0' + s % 10, s /= 10;
+		while (s);
+		while (pos > buf + 10)
+			*--pos = ' ';
+	}
+}
+
+/* the display path of a node, for error messages from worker threads */
+static char *
+nodepath(struct node *n)
+{
+	struct node *p;
+	size_t len;
+	char *buf, *pos;
+
+	/* path names the root node while rmtree() waits for the workers */
+	len = pathlen + 1;
+	for (p = n; p->parent; p = p->parent)
+		len += strlen(p->name) + 1;
+	buf = malloc(len);
+	if (!buf)
+		return n->name;
+	pos = buf + len;
+	*--pos = '\0';
+	for (p = n; p->parent; p = p->parent) {
+		pos -= strlen(p->name);
+		memcpy(pos, p->name, strlen(p->name));
+		*--pos = '/';
+	}
+	memcpy(buf, path, pathlen);
+	return buf;
+}
+
+static struct node *
+mknode(struct node *parent, const char *name)
+{
+	struct node *n;
+	size_t len;
+
+	len = strlen(name);
+	n = malloc(sizeof(*n) + len + 1);
+	if (!n)
+		fatal(NULL);
+	memcpy(n->name, name, len + 1);
+	n->parent = parent;
+	n->child = NULL;
+	n->next = NULL;
+	n->fd = -1;
+	n->pending = 1;
+	return n;
+}
+
+/* list a directory, removing its files and queueing its subdirectories */
+static void
+rmscan(struct node *n, char *buf)
+{
+	struct dirent64 *ent;
+	struct node *c, *dirs = NULL, **last;
+	struct stat st;
+	size_t ndirs = 0, off;
+	ssize_t ret;
+	unsigned long long nsys = 0;
+
+	if (n->fd == -1) {
+		++nsys;
+		n->fd = openat(n->parent->fd, n->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (n->fd < 0)
+			fatal("open %s:", nodepath(n));
+		++nsys;
+		if (fstat(n->fd, &st) != 0)
+			fatal("stat %s:", nodepath(n));
+		n->mode = st.st_mode;
+		n->size = 0;
+	}
+	last = &n->child;
+	while (++nsys, (ret = syscall(SYS_getdents64, n->fd, buf, DIRBUF)) != 0) {
+		if (ret < 0)
+			fatal("getdents %s:", nodepath(n));
+		for (off = 0; off < ret; off += ent->d_reclen) {
+			const char *name;
+
+			ent = (struct dirent64 *)(buf + off);
+			name = ent->d_name;
+			if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+				continue;
+			c = mknode(n, name);
+			*last = c;
+			last = &c->next;
+			if (ent->d_type != DT_DIR) {
+				++nsys;
+				if (fstatat(n->fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+					fatal("stat %s:", nodepath(c));
+				c->mode = st.st_mode;
+				c->size = st.st_size;
+			} else {
+				c->mode = S_IFDIR;
+			}
+			if (S_ISDIR(c->mode)) {
+				c->qnext = dirs;
+				dirs = c;
+				++ndirs;
+			} else if (!rm.dry) {
+				++nsys;
+				if (unlinkat(n->fd, name, 0) != 0)
+					fatal("remove %s:", nodepath(c));
+			}
+		}
+	}
+
+	pthread_mutex_lock(&rm.lock);
+	stats[STATSYSCALLS] += nsys;
+	n->pending += ndirs;
+	if (dirs) {
+		for (c = dirs; c->qnext; c = c->qnext)
+			;
+		c->qnext = rm.queue;
+		rm.queue = dirs;
+		pthread_cond_broadcast(&rm.work);
+	}
+	pthread_mutex_unlock(&rm.lock);
+}
+
+/* drop one reference to a directory, removing it and then its parents once they are empty */
+static void
+rmdone(struct node *n)
+{
+	struct node *p;
+	unsigned long long nsys;
+	int fd;
+
+	for (; n; n = p) {
+		pthread_mutex_lock(&rm.lock);
+		if (--n->pending > 0) {
+			pthread_mutex_unlock(&rm.lock);
+			break;
+		}
+		pthread_mutex_unlock(&rm.lock);
+		p = n->parent;
+		fd = p ? p->fd : rm.dirfd;
+		nsys = 1;
+		close(n->fd);
+		if (!rm.dry && (p || rm.removeroot)) {
+			++nsys;
+			if (unlinkat(fd, n->name, AT_REMOVEDIR) != 0)
+				fatal("remove %s:", nodepath(n));
+		}
+		pthread_mutex_lock(&rm.lock);
+		stats[STATSYSCALLS] += nsys;
+		if (!p) {
+			rm.finished = 1;
+			pthread_cond_signal(&rm.done);
+		}
+		pthread_mutex_unlock(&rm.lock);
+	}
+}
+
+static void *
+rmworker(void *arg)
+{
+	struct node *n;
+	char *buf, *name;
+	long long start = 0;
+
+	buf = malloc(DIRBUF);
+	if (!buf)
+		fatal(NULL);
+	for (;;) {
+		pthread_mutex_lock(&rm.lock);
+		while (!rm.queue)
+			pthread_cond_wait(&rm.work, &rm.lock);
+		n = rm.queue;
+		rm.queue = n->qnext;
+		pthread_mutex_unlock(&rm.lock);
+		if (tracing)
+			start = tracenow();
+		rmscan(n, buf);
+		if (tracing) {
+			name = nodepath(n);
+			tracespan(PHASEDELETE, name == n->name ? name : name + baselen, start, tracenow());
+			if (name != n->name)
+				free(name);
+		}
+		rmdone(n);
+	}
+	return NULL;
+}
+
+static int
+nodecmp(const void *p1, const void *p2)
+{
+	return pathcmp((*(struct node **)p1)->name, (*(struct node **)p2)->name, NULL);
+}
+
+/* print the removed files in manifest order, children before their directory, and free their nodes */
+static void
+rmreport(struct node *n, int print)
+{
+	struct node **child, *c;
+	char info[19];
+	size_t len, i, oldlen;
+
+	len = 0;
+	for (c = n->child; c; c = c->next)
+		++len;
+	child = reallocarray(NULL, len, sizeof(child[0]));
+	if (len && !child)
+		fatal(NULL);
+	for (c = n->child, i = 0; c; c = c->next)
+		child[i++] = c;
+	qsort(child, len, sizeof(child[0]), nodecmp);
+	oldlen = pathlen;
+	for (i = 0; i < len; ++i) {
+		c = child[i];
+		pathadd(oldlen, c->name);
+		if (S_ISDIR(c->mode))
+			rmreport(c, print);
+		if (print) {
+			infostring(info, sizeof(info), c->mode, c->size);
+			printf("%-48s %-18s → delete\n", path + baselen, info);
+			++stats[STATDELETED];
+		}
+		free(c);
+	}
+	free(child);
+	pathlen = oldlen;
+	path[pathlen] = '\0';
+}
+
+/*
+remove the directory tree at path using a pool of threads, and
+report it in the same order as a serial traversal
+*/
+static void
+rmtree(int dirfd, const char *name, int flags)
+{
+	struct node *n;
+	struct stat st;
+	char info[19];
+	pthread_t tid;
+	long i, nthreads;
+	int phase, dry;
+
+	if (!rm.started) {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nthreads < RMTHREADS)
+			nthreads = RMTHREADS;
+		for (i = 0; i < nthreads; ++i) {
+			if (pthread_create(&tid, NULL, rmworker, NULL) != 0)
+				fatal("pthread_create:");
+		}
+		rm.started = 1;
+	}
+
+	phase = statphase(PHASEDELETE);
+	n = mknode(NULL, name);
+	dry = flags & RMQUIET ? 0 : dflag || xflag;
+	++stats[STATSYSCALLS];
+	n->fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (n->fd < 0)
+		fatal("open %s:", path);
+	++stats[STATSYSCALLS];
+	if (fstat(n->fd, &st) != 0)
+		fatal("stat %s:", path);
+	n->mode = st.st_mode;
+	n->size = 0;
+
+	pthread_mutex_lock(&rm.lock);
+	rm.dirfd = dirfd;
+	rm.removeroot = flags & RMROOT;
+	rm.dry = dry;
+	rm.finished = 0;
+	n->qnext = NULL;
+	rm.queue = n;
+	pthread_cond_signal(&rm.work);
+	while (!rm.finished)
+		pthread_cond_wait(&rm.done, &rm.lock);
+	pthread_mutex_unlock(&rm.lock);
+
+	rmreport(n, !(flags & RMQUIET));
+	if ((flags & (RMROOT | RMQUIET)) == RMROOT) {
+		infostring(info, sizeof(info), n->mode, n->size);
+		printf("%-48s %-18s → delete\n", path + baselen, info);
+		++stats[STATDELETED];
+	}
+	free(n);
+	statphase(phase);
+}
+
+static void
+delete(int dirfd, const char *name, int type)
+{
+	char info[19];
+	struct stat st;
+	const char *record;
+	int phase;
+
+	phase = statphase(PHASEDELETE);
+	record = tracerecord("");
+	if (type != DT_DIR) {
+		++stats[STATSYSCALLS];
+		if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+			fatal("stat %s:", path);
+		if (!S_ISDIR(st.st_mode)) {
+			infostring(info, sizeof(info), st.st_mode, st.st_size);
+			printf("%-48s %-18s → delete\n", path + baselen, info);
+			++stats[STATDELETED];
+			if (!dflag && !xflag) {
+				++stats[STATSYSCALLS];
+				if (unlinkat(dirfd, name, 0) < 0)
+					fatal("remove %s:", path);
+			}
+			goto done;
+		}
+	}
+	rmtree(dirfd, name, RMROOT);
+done:
+	/* label the span with the removed path; the buffer may have moved */
+	tracerecord(path + baselen);
+	statphase(phase);
+	tracerecord(record);
+}
+
+static void
+fspec(char *pos, size_t len)
+{
+	char tmp[8], old[19], new[19], *end;
+	const char *name, *base, *wbase, *source, *target = NULL;
+	unsigned char remotehash[BLAKE3_OUT_LEN], localhash[BLAKE3_OUT_LEN], tree[BLAKE3_OUT_LEN];
+	mode_t mode = 0, omode;
+	off_t size = 0;
+	struct stat st;
+	struct entry *ent;
+	size_t n;
+	long i;
+	int ret, replace, fd, wfd, tmpfd = -1, phase, hastree = 0;
+
+	/* name */
+	name = pos;
+	end = memchr(pos, '\n', len);
+	*end = 0;
+	assert(name[0] == '/');
+	if (skip && strncmp(name, skip, skiplen) == 0 && (skiplen == 1 || name[skiplen] == '/')) {
+		++stats[STATUNCHANGED];
+		return;
+	}
+	source = name + 1;
+	tracerecord(name);
+	len -= end + 1 - pos;
+	pos = end + 1;
+
+	checkpath(path + baselen, name);
+
+	/* delete files not present in manifest */
+	while (dir && !dirhas(name))
+		dirpop();
+	ent = NULL;
+	while (dir && dir->pos < dir->len) {
+		pathadd(dir->pathlen, dir->names + dir->ent[dir->pos].name);
+		ret = pathcmp(path + baselen, name, NULL);
+		if (ret > 0)
+			break;
+		++dir->pos;
+		if (ret == 0) {
+			ent = &dir->ent[dir->pos - 1];
+			break;
+		}
+		delete(dir->fd, dir->names + dir->ent[dir->pos - 1].name, dir->ent[dir->pos - 1].type);
+	}
+
+	while (len > 0) {
+		end = memchr(pos, '\n', len);
+		assert(end);
+		*end = 0;
+		len -= end + 1 - pos;
+		if (strncmp(pos, "type=", 5) == 0) {
+			pos += 5;
+			if (strcmp(pos, "reg") == 0)
+				mode = (mode & ~S_IFMT) | S_IFREG;
+			else if (strcmp(pos, "sym") == 0)
+				mode = (mode & ~S_IFMT) | S_IFLNK;
+			else if (strcmp(pos, "dir") == 0)
+				mode = (mode & ~S_IFMT) | S_IFDIR;
+			else
+				fatal("file '%s' has unsupported type '%s'", name, pos);
+		} else if (strncmp(pos, "mode=", 5) == 0) {
+			pos += 5;
+			mode = (mode & S_IFMT) | strtoul(pos, &end, 8);
+			if (*end)
+				fatal("file '%s' has unsupported mode '%s'", name, pos);
+		} else if (strncmp(pos, "size=", 5) == 0) {
+			pos += 5;
+			size = strtoull(pos, &end, 10);
+			if (*end)
+				fatal("file '%s' has unsupported size '%s'", name, pos);
+		} else if (strncmp(pos, "source=", 7) == 0) {
+			pos += 7;
+			source = pos;
+		} else if (strncmp(pos, "target=", 7) == 0) {
+			pos += 7;
+			target = pos;
+		} else if (strncmp(pos, "blake3=", 7) == 0) {
+			pos += 7;
+			if (end - pos != sizeof(remotehash) * 2 || hexdec(remotehash, pos, sizeof(remotehash)) != 0)
+				fatal("file '%s' has invalid blake3 attribute", name);
+		} else if (strncmp(pos, "tree=", 5) == 0) {
+			pos += 5;
+			if (end - pos != sizeof(tree) * 2 || hexdec(tree, pos, sizeof(tree)) != 0)
+				fatal("file '%s' has invalid tree attribute", name);
+			hastree = 1;
+		}
+		pos = end + 1;
+	}
+
+	if (strcmp(name, "/") == 0) {
+		if (!S_ISDIR(mode))
+			fatal("file '/' must be a directory");
+		fd = AT_FDCWD;
+		base = root;
+		wfd = AT_FDCWD;
+		wbase = xflag ? stage : root;
+	} else {
+		if (!dir) {
+			/* no root entry, so only descend into the tree */
+			if (xflag)
+				fatal("shadow tree needs a root entry");
+			fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (fd < 0 && errno != ENOENT)
+				fatal("open %s:", root);
+			rootfd = fd;
+			pathlen = baselen;
+			dirpush(fd, -1);
+		}
+		base = strrchr(name, '/');
+		if (base - name != dir->pathlen - baselen)
+			fatal("file '%s' is not in a directory", name);
+		fd = dir->fd;
+		wfd = dir->wfd;
+		wbase = ++base;
+		pathadd(baselen, name + 1);
+	}
+
+	/* the parent listing tells whether the file exists, and sometimes its type */
+	phase = statphase(PHASESTAT);
+	if (fd == -1 || (dir && dir->complete && !ent)) {
+		st.st_mode = 0;
+	} else if (cur && cur->state == AHEADSTATED && ent && ent->ino == cur->stx.stx_ino) {
+		/* a prefetched hash is only trusted after a fresh stat below */
+		st.st_mode = cur->stx.stx_mode;
+		st.st_size = cur->stx.stx_size;
+		st.st_ino = cur->stx.stx_ino;
+		st.st_mtim.tv_sec = cur->stx.stx_mtime.tv_sec;
+		st.st_mtim.tv_nsec = cur->stx.stx_mtime.tv_nsec;
+	} else if (ent && ent->type == DT_LNK) {
+		st.st_mode = S_IFLNK | 0777;
+		st.st_size = 0;
+	} else if (++stats[STATSYSCALLS], fstatat(fd, base, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+		if (errno != ENOENT)
+			fatal("lstat %s:", name);
+		st.st_mode = 0;
+	}
+	if (st.st_mode) {
+		if (S_ISDIR(st.st_mode) && !S_ISDIR(mode))
+			rmtree(fd, base, 0);
+		infostring(old, sizeof(old), st.st_mode, st.st_size);
+	} else {
+		old[0] = '\0';
+	}
+
+	replace = 0;
+	switch (mode & S_IFMT) {
+	case S_IFREG:
+		replace = 1;
+		if (S_ISREG(st.st_mode) && cur && cur->state == AHEADHASHED
+		 && cur->stx.stx_ino == st.st_ino && cur->stx.stx_size == st.st_size
+		 && cur->stx.stx_mtime.tv_sec == st.st_mtim.tv_sec && cur->stx.stx_mtime.tv_nsec == st.st_mtim.tv_nsec) {
+			memcpy(localhash, cur->hash, sizeof(localhash));
+			if (memcmp(localhash, remotehash, sizeof(localhash)) == 0) {
+				replace = 0;
+				size = st.st_size;
+			}
+		} else if (S_ISREG(st.st_mode)) {
+			blake3_hasher ctx;
+			char buf[16384];
+			ssize_t ret;
+			int lfd;
+
+			statphase(PHASEHASH);
+			++stats[STATSYSCALLS];
+			lfd = openat(fd, base, O_RDONLY | O_CLOEXEC);
+			if (lfd < 0)
+				fatal("open %s:", path);
+			blake3_hasher_init(&ctx);
+			while (++stats[STATSYSCALLS], (ret = read(lfd, buf, sizeof(buf))) > 0) {
+				blake3_hasher_update(&ctx, buf, ret);
+				stats[STATHASHED] += ret;
+			}
+			++stats[STATSYSCALLS];
+			close(lfd);
+			if (ret < 0)
+				fatal("read %s:", path);
+			blake3_hasher_finalize(&ctx, localhash, sizeof(localhash));
+			statphase(PHASESTAT);
+			if (memcmp(localhash, remotehash, sizeof(localhash)) == 0) {
+				replace = 0;
+				size = st.st_size;
+			}
+		}
+		if (replace && !dflag) {
+			statphase(PHASEFETCH);
+			size = fetch(tmp, name, source, size, localhash, &tmpfd);
+			if (memcmp(localhash, remotehash, sizeof(localhash)) != 0)
+				fatal("file '%s' has incorrect hash", name);
+		} else if (xflag && mode != st.st_mode) {
+			/* a link would change the mode in the live tree too */
+			statphase(PHASEFETCH);
+			clonefile(tmp, fd, base, &tmpfd);
+			replace = 1;
+		}
+		if (replace && !dflag) {
+			++stats[STATSYSCALLS];
+			if (fchmodat(rootfd, tmp, mode & ~S_IFMT, 0) != 0)
+				fatal("chmod %s:", path);
+			statphase(PHASESTAT);
+		}
+		break;
+	case S_IFDIR:
+		replace = !S_ISDIR(st.st_mode);
+		break;
+	case S_IFLNK:
+		replace = 1;
+		if (S_ISLNK(st.st_mode)) {
+			char *localtarget = NULL;
+			size_t max;
+			ssize_t ret;
+
+			for (max = st.st_size + 128;; max *= 2) {
+				localtarget = realloc(localtarget, max);
+				if (!localtarget)
+					fatal(NULL);
+				++stats[STATSYSCALLS];
+				ret = readlinkat(fd, base, localtarget, max);
+				if (ret < 0)
+					break;
+				if (ret < max) {
+					localtarget[ret] = '\0';
+					replace = strcmp(localtarget, target) != 0;
+					break;
+				}
+			}
+			free(localtarget);
+		}
+		if (replace && !dflag)
+			tmpcreate(tmp, target);
+		break;
+	default:
+		fatal("file '%s' is missing type");
+	}
+	statphase(PHASERENAME);
+	if (replace || (!S_ISLNK(mode) && mode != st.st_mode)) {
+		infostring(new, sizeof(new), mode, size);
+		if (old[0]) {
+			char rel[10];
+
+			rel[0] = '\0';
+			if (S_ISREG(st.st_mode) && S_ISREG(mode))
+				snprintf(rel, sizeof(rel), " (%3d%%)", (int)(size * 100 / st.st_size));
+			printf("%-48s %-18s → %s%s\n", name, old, new, rel);
+		} else {
+			printf("%-69s %s\n", name, new);
+		}
+	} else {
+		++stats[STATUNCHANGED];
+	}
+	if (!dflag) {
+		/* with -x the old file stays in the live tree, and nothing is in the way in the new one */
+		omode = xflag ? 0 : st.st_mode;
+		if (xflag && !replace && !S_ISDIR(mode)) {
+			/* carry the unchanged file over to the new tree */
+			++stats[STATSYSCALLS];
+			if (linkat(fd, base, wfd, wbase, 0) != 0) {
+				/* across a mount below the root, past the link limit, or with protected hardlinks */
+				if (errno != EXDEV && errno != EMLINK && errno != EPERM)
+					fatal("link %s:", path);
+				statphase(PHASEFETCH);
+				if (S_ISLNK(mode)) {
+					tmpcreate(tmp, target);
+				} else {
+					clonefile(tmp, fd, base, &tmpfd);
+					++stats[STATSYSCALLS];
+					if (fchmodat(rootfd, tmp, mode & ~S_IFMT, 0) != 0)
+						fatal("chmod %s:", path);
+				}
+				statphase(PHASERENAME);
+				replace = 1;
+			}
+		}
+		if (replace) {
+			if (S_ISDIR(mode)) {
+				if (omode && !S_ISDIR(omode)) {
+					++stats[STATSYSCALLS];
+					if (unlinkat(fd, base, 0) != 0)
+						fatal("unlink %s:", path);
+				}
+				++stats[STATSYSCALLS];
+				if (mkdirat(wfd, wbase, mode & ~S_IFMT) != 0)
+					fatal("mkdir %s:", path);
+				building |= wbase == stage;
+				syncdir(wfd);
+			} else if (durability == DURABLEBATCH) {
+				struct rename *r;
+
+				if (nrenames == RENAMEBATCH)
+					flushrenames();
+				r = &renames[nrenames++];
+				r->fd = tmpfd;
+				r->dirfd = wfd;
+				r->rmdir = S_ISDIR(omode);
+				memcpy(r->tmp, tmp, sizeof(tmp));
+				r->name = strdup(wbase);
+				if (!r->name)
+					fatal(NULL);
+			} else {
+				if (S_ISDIR(omode)) {
+					++stats[STATSYSCALLS];
+					if (unlinkat(fd, base, AT_REMOVEDIR) != 0)
+						fatal("rmdir %s:", path);
+				}
+				++stats[STATSYSCALLS];
+				if (renameat(rootfd, tmp, wfd, wbase) != 0)
+					fatal("rename:");
+				syncdir(wfd);
+			}
+		} else if (xflag) {
+			/* files were linked above */
+			if (S_ISDIR(mode)) {
+				++stats[STATSYSCALLS];
+				if (mkdirat(wfd, wbase, mode & ~S_IFMT) != 0)
+					fatal("mkdir %s:", path);
+				building |= wbase == stage;
+			}
+			syncdir(wfd);
+		} else if (!S_ISLNK(mode) && mode != st.st_mode) {
+			++stats[STATSYSCALLS];
+			if (fchmodat(fd, base, mode & ~S_IFMT, 0) != 0)
+				fatal("chmod %s:", path);
+		}
+	}
+	statphase(PHASESTAT);
+	if (S_ISDIR(mode) && hastree && S_ISDIR(st.st_mode) && (i = statefind(name + 1)) != -1
+	 && memcmp(state[i].tree, tree, sizeof(tree)) == 0 && (n = statecheck(i)) > 0) {
+		/* the subtree is as a previous run left it, so pass over its records */
+		free(skip);
+		skip = strdup(name);
+		if (!skip)
+			fatal(NULL);
+		skiplen = strlen(skip);
+		for (; i < n; ++i)
+			stateadd(&state[i]);
+	} else if (S_ISDIR(mode)) {
+		int dfd = -1, wdfd;
+
+		if ((!dflag && !xflag) || S_ISDIR(st.st_mode)) {
+			++stats[STATSYSCALLS];
+			dfd = openat(fd, base, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (dfd < 0)
+				fatal("open %s:", path);
+		}
+		wdfd = dfd;
+		if (xflag) {
+			++stats[STATSYSCALLS];
+			wdfd = openat(wfd, wbase, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (wdfd < 0)
+				fatal("open %s:", path);
+		}
+		if (fd == AT_FDCWD)
+			rootfd = wdfd;
+		dirpush(dfd, S_ISDIR(st.st_mode));
+		dir->wfd = wdfd;
+		if (statefile && hastree && !dflag) {
+			struct state e = {.path = strdup(name)};
+
+			if (!e.path)
+				fatal(NULL);
+			memcpy(e.tree, tree, sizeof(tree));
+			dir->state = stateadd(&e);
+		}
+	}
+	statphase(phase);
+	tracerecord("");
+}
+
+/* advance a prefetch after one of its operations completes */
+static int
+aheadstep(struct ahead *a, int res)
+{
+	switch (a->state) {
+	case AHEADSTAT:
+		if (res < 0) {
+			a->state = AHEADNONE;
+			return 0;
+		}
+		a->state = AHEADSTATED;
+		if (!a->reg || !S_ISREG(a->stx.stx_mode))
+			return 0;
+		a->state = AHEADOPEN;
+		return uringopenat(ring, a, aheadfd, win + a->name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	case AHEADOPEN:
+		if (res < 0) {
+			a->state = AHEADSTATED;
+			return 0;
+		}
+		a->fd = res;
+		a->off = 0;
+		a->buf = malloc(AHEADBUF);
+		if (!a->buf)
+			fatal(NULL);
+		blake3_hasher_init(&a->ctx);
+		a->state = AHEADREAD;
+		return uringread(ring, a, a->fd, a->buf, AHEADBUF, 0);
+	case AHEADREAD:
+		if (res > 0) {
+			blake3_hasher_update(&a->ctx, a->buf, res);
+			stats[STATHASHED] += res;
+			a->off += res;
+			return uringread(ring, a, a->fd, a->buf, AHEADBUF, a->off);
+		}
+		++stats[STATSYSCALLS];
+		close(a->fd);
+		free(a->buf);
+		a->state = AHEADSTATED;
+		if (res == 0 && a->off == a->stx.stx_size) {
+			blake3_hasher_finalize(&a->ctx, a->hash, sizeof(a->hash));
+			a->state = AHEADHASHED;
+		}
+		return 0;
+	}
+	return 0;
+}
+
+/*
+stat, and for regular files hash, every record in the window with
+io_uring, keeping one operation in flight per record
+*/
+static void
+prefetch(void)
+{
+	struct ahead *a;
+	size_t i, inflight;
+	void *data;
+	int res, phase;
+
+	if (aheadfd < 0) {
+		aheadfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (aheadfd < 0)
+			return;
+	}
+	tracerecord("");
+	phase = statphase(PHASEPREFETCH);
+	inflight = 0;
+	for (i = 0; i < naheads; ++i) {
+		a = &ahead[i];
+		if (!win[a->name])
+			continue;
+		a->state = AHEADSTAT;
+		if (uringstatx(ring, a, aheadfd, win + a->name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &a->stx) != 0)
+			fatal("io_uring: submission queue is full");
+		++inflight;
+	}
+	while (inflight > 0) {
+		if (uringwait(ring, &data, &res) != 0)
+			fatal("io_uring_enter:");
+		--inflight;
+		a = data;
+		if (aheadstep(a, res) != 0)
+			fatal("io_uring: submission queue is full");
+		if (a->state == AHEADOPEN || a->state == AHEADREAD)
+			++inflight;
+	}
+	statphase(phase);
+}
+
+static void
+aheadflush(void)
+{
+	size_t i;
+
+	prefetch();
+	for (i = 0; i < naheads; ++i) {
+		cur = &ahead[i];
+		fspec(win + cur->rec, cur->reclen);
+	}
+	cur = NULL;
+	naheads = 0;
+	winlen = 0;
+}
+
+/* queue a record in the lookahead window */
+static void
+fspecahead(char *pos, size_t len)
+{
+	struct ahead *a;
+	unsigned char hash[BLAKE3_OUT_LEN];
+	char *end, *tree;
+	size_t namelen;
+	long i;
+
+	end = memchr(pos, '\n', len);
+	assert(end);
+	namelen = end - pos - 1;
+	if (skip && namelen >= skiplen && memcmp(pos, skip, skiplen) == 0 && (skiplen == 1 || pos[skiplen] == '/')) {
+		++stats[STATUNCHANGED];
+		return;
+	}
+	if (winmax - winlen < len + namelen + 1) {
+		winmax = winlen + len + namelen + 1 > winmax * 2 ? winlen + len + namelen + 1 : winmax * 2;
+		win = realloc(win, winmax);
+		if (!win)
+			fatal(NULL);
+	}
+	a = &ahead[naheads++];
+	a->state = AHEADNONE;
+	a->reg = memmem(pos, len, "\ntype=reg\n", 10) != NULL;
+	a->rec = winlen;
+	a->reclen = len;
+	memcpy(win + winlen, pos, len);
+	winlen += len;
+	a->name = winlen;
+	memcpy(win + winlen, pos + 1, namelen);
+	winlen += namelen;
+	win[winlen++] = '\0';
+	/* decide on skipping a subtree before its records are prefetched */
+	if (nstate > 0 && (tree = memmem(pos, len, "\ntree=", 6)) && hexdec(hash, tree + 6, sizeof(hash)) == 0
+	 && (i = statefind(win + a->name)) != -1 && memcmp(state[i].tree, hash, sizeof(hash)) == 0)
+		aheadflush();
+	else if (naheads == AHEAD)
+		aheadflush();
+}
+
+static void
+syncrecord(struct stage *s, char *pos, size_t len)
+{
+	/* without io_uring, records are processed one at a time */
+	if (ring)
+		fspecahead(pos, len);
+	else
+		fspec(pos, len);
+}
+
+/* put the new tree in the place of the live one, leaving the old tree at the stage name */
+static mode_t
+swaproot(void)
+{
+	struct stat st;
+	int fd;
+
+	statphase(PHASERENAME);
+	if (durability != DURABLENONE) {
+		/* the new tree must be on disk before it becomes visible */
+		++stats[STATSYSCALLS];
+		fd = open(stage, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			fatal("open %s:", stage);
+		++stats[STATSYSCALLS];
+		if (syncfs(fd) != 0)
+			fatal("syncfs %s:", stage);
+		++stats[STATSYSCALLS];
+		close(fd);
+	}
+	++stats[STATSYSCALLS];
+	if (lstat(swapname, &st) != 0) {
+		if (errno != ENOENT)
+			fatal("lstat %s:", root);
+		st.st_mode = 0;
+	}
+	++stats[STATSYSCALLS];
+	if (renameat2(AT_FDCWD, stage, AT_FDCWD, swapname, st.st_mode ? RENAME_EXCHANGE : RENAME_NOREPLACE) != 0)
+		fatal("rename %s %s:", stage, root);
+	building = 0;
+	return st.st_mode;
+}
+
+static int
+rmentry(const char *name, const struct stat *st, int type, struct FTW *ftw)
+{
+	remove(name);
+	return 0;
+}
+
+/* on failure, remove the partly built tree, which may be as large as the live one */
+static void
+rmstage(void)
+{
+	if (building)
+		nftw(stage, rmentry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/*
+resolve the parent of the root, so the stage is a real sibling even for
+names like . or .., and check that the root can be renamed at all
+*/
+static char *
+resolveroot(void)
+{
+	char *name, *base, *dir, *real, *full;
+	struct stat st, pst;
+	size_t len;
+
+	name = strdup(root);
+	if (!name)
+		fatal(NULL);
+	for (len = strlen(name); len > 1 && name[len - 1] == '/';)
+		name[--len] = '\0';
+	base = strrchr(name, '/');
+	base = base ? base + 1 : name;
+	if (!*base || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+		real = realpath(name, NULL);
+		if (!real)
+			fatal("realpath %s:", root);
+		free(name);
+		name = real;
+		base = strrchr(name, '/') + 1;
+	}
+	if (!*base)
+		fatal("cannot swap %s, the root of the filesystem", root);
+	if (base == name) {
+		dir = ".";
+	} else if (base == name + 1) {
+		dir = "/";
+	} else {
+		base[-1] = '\0';
+		dir = name;
+	}
+	real = realpath(dir, NULL);
+	if (!real)
+		fatal("realpath %s:", dir);
+	full = malloc(strlen(real) + strlen(base) + 2);
+	if (!full)
+		fatal(NULL);
+	sprintf(full, "%s/%s", strcmp(real, "/") == 0 ? "" : real, base);
+
+	/* a mount point cannot be renamed, which would only show after the whole build */
+	if (lstat(full, &st) != 0) {
+		if (errno != ENOENT)
+			fatal("lstat %s:", root);
+	} else if (S_ISDIR(st.st_mode)) {
+		if (stat(real, &pst) != 0)
+			fatal("stat %s:", real);
+		if (st.st_dev != pst.st_dev)
+			fatal("cannot swap %s, a mount point", root);
+#ifdef STATX_ATTR_MOUNT_ROOT
+		{
+			struct statx stx;
+
+			/* bind mounts of the same filesystem keep the device */
+			if (statx(AT_FDCWD, full, AT_SYMLINK_NOFOLLOW, 0, &stx) == 0
+			 && stx.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT && stx.stx_attributes & STATX_ATTR_MOUNT_ROOT)
+				fatal("cannot swap %s, a mount point", root);
+		}
+#endif
+	}
+	free(real);
+	free(name);
+	return full;
+}
+
+static void
+syncend(struct stage *s)
+{
+	mode_t old = 0;
+	int fd;
+
+	if (ring)
+		aheadflush();
+	while (dir)
+		dirpop();
+	if (tarfd >= 0)
+		tardrain();
+	if (xflag)
+		old = swaproot();
+	if (statefile && !dflag)
+		statewrite();
+	if (durability != DURABLENONE && !dflag) {
+		statphase(PHASERENAME);
+		++stats[STATSYSCALLS];
+		fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			fatal("open %s:", root);
+		++stats[STATSYSCALLS];
+		if (syncfs(fd) != 0)
+			fatal("syncfs %s:", root);
+		++stats[STATSYSCALLS];
+		close(fd);
+	}
+	if (S_ISDIR(old)) {
+		/* path names the tree being removed, for errors */
+		pathlen = strlen(stage);
+		memcpy(path, stage, pathlen + 1);
+		rmtree(AT_FDCWD, stage, RMROOT | RMQUIET);
+	} else if (old) {
+		++stats[STATSYSCALLS];
+		if (unlink(stage) != 0)
+			fatal("unlink %s:", stage);
+	}
+}
+
+/* a sink that makes the tree at rootdir match the records */
+struct stage *
+syncstage(char *rootdir, const struct syncopt *opt)
+{
+	static struct stage s = {syncrecord, syncend};
+	size_t len;
+
+	umask(0);
+	root = rootdir;
+	fetchdir = opt->srcdir;
+	tarfd = opt->tarfd;
+	tarseek = tarfd >= 0 && lseek(tarfd, 0, SEEK_CUR) != -1;
+	dflag = (opt->flags & SYNCDRYRUN) != 0;
+	xflag = (opt->flags & SYNCSHADOW) != 0 && !dflag;
+	durability = opt->durability;
+	statefile = opt->statefile;
+	if (xflag && statefile)
+		fatal("a shadow tree cannot skip subtrees with a state file");
+	if (statefile)
+		stateload();
+	baselen = strlen(root);
+	pathmax = baselen + 256;
+	path = malloc(pathmax);
+	if (!path)
+		fatal(NULL);
+	memcpy(path, root, baselen + 1);
+	pathlen = baselen;
+	if (xflag) {
+		/* a sibling of the root, so that files can be linked and the roots swapped */
+		swapname = resolveroot();
+		len = strlen(swapname);
+		stage = malloc(len + 8);
+		if (!stage)
+			fatal(NULL);
+		memcpy(stage, swapname, len);
+		memcpy(stage + len, ".XXXXXX", 8);
+		randname(stage + len + 1);
+		if (atexit(rmstage) != 0)
+			fatal("atexit:");
+	}
+	if (opt->flags & SYNCURING)
+		ring = uringnew(AHEAD * 2);
+	return &s;
+}
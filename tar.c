@@ -0,0 +1,686 @@
+#define _GNU_SOURCE /* for SEEK_DATA, SEEK_HOLE */
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "common.h"
+
+enum {
+	REGTYPE = '0',
+	SYMTYPE = '2',
+	DIRTYPE = '5',
+	PAXTYPE = 'x',
+};
+
+struct extent {
+	off_t off, len;
+};
+
+/* an archive being written; each shard has its own */
+struct tarout {
+	FILE *file;
+	const char *name;
+	int main;  /* written by the main thread, which may switch phases */
+	struct extent *map;
+	size_t mapcap;
+	char *ext;
+	size_t extlen, extcap;
+	unsigned long long syscalls, copied;
+};
+
+struct rec {
+	size_t off, len, namelen;
+	off_t weight;
+	int dir;
+};
+
+/* a self-contained archive of a range of the records */
+struct shard {
+	struct tarout out;
+	size_t *dirs, ndirs;  /* ancestors of the first record, from earlier shards */
+	size_t first, last;
+	pthread_t tid;
+};
+
+static struct tarout out;
+static struct shard *shards;
+static size_t nshards;
+static char *buf;
+static size_t buflen, bufmax;
+static struct rec *recs;
+static size_t nrecs, recsmax;
+
+static unsigned long
+decnum(const char *s, size_t l, int *err)
+{
+	unsigned long n;
+
+	n = 0;
+	for (; l > 0; --l, ++s) {
+		if (*s < '0' || *s > '9') {
+			if (err)
+				*err = 1;
+			return 0;
+		}
+		n = n * 10 + (*s - '0');
+	}
+	if (err)
+		*err = 0;
+	return n;
+}
+
+static int
+isodigit(int c)
+{
+	return '0' <= c && c <= '7';
+}
+
+static void
+extprintf(struct tarout *t, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	for (;;) {
+		va_start(ap, fmt);
+		ret = vsnprintf(t->ext + t->extlen, t->extcap - t->extlen, fmt, ap);
+		va_end(ap);
+		if (ret < 0)
+			fatal("vsnprintf:");
+		if (ret < t->extcap - t->extlen)
+			break;
+		t->extcap = t->extlen + ret + 1 > t->extcap * 2 ? t->extlen + ret + 1 : t->extcap * 2;
+		t->ext = realloc(t->ext, t->extcap);
+		if (!t->ext)
+			fatal(NULL);
+	}
+	t->extlen += ret;
+}
+
+static void
+paxrec(struct tarout *t, const char *key, const char *val)
+{
+	size_t len, n;
+
+	len = strlen(key) + strlen(val) + 3;
+	for (n = len + 1; len + snprintf(NULL, 0, "%zu", n) > n; ++n)
+		;
+	extprintf(t, "%zu %s=%s\n", n, key, val);
+}
+
+static void
+inithdr(char hdr[static 512])
+{
+	memset(hdr, 0, 512);
+	memset(hdr + 108, '0', 7);     /* uid */
+	memset(hdr + 116, '0', 7);     /* gid */
+	memset(hdr + 124, '0', 11);    /* size */
+	memset(hdr + 136, '0', 11);    /* mtime */
+	memcpy(hdr + 257, "ustar", 6); /* magic */
+	memcpy(hdr + 263, "00", 2);    /* version */
+}
+
+static void
+setname(char hdr[static 512], const char *name, size_t len)
+{
+	size_t i;
+
+	memset(hdr + 0, 0, 100);
+	memset(hdr + 345, 0, 155);
+	if (len > 100) {
+		for (i = len - 1 < 155 ? len - 1 : 155; i > 0 && name[i] != '/'; --i)
+			;
+		if (i == 0 || len - i - 1 > 100)
+			fatal("path is too long");
+		memcpy(hdr + 345, name, i);
+		name += i + 1, len -= i + 1;
+	}
+	memcpy(hdr + 0, name, len);
+}
+
+static void
+setsize(char hdr[static 512], const char *name, off_t size)
+{
+	int ret;
+
+	ret = snprintf(hdr + 124, 12, "%011jo", (uintmax_t)size);
+	if (ret < 0 || ret >= 12)
+		fatal("file '%s' is too large", name);
+}
+
+static void
+writehdr(struct tarout *t, char hdr[static 512])
+{
+	unsigned long chksum;
+	size_t i;
+
+	memset(hdr + 148, ' ', 8);
+	chksum = 0;
+	for (i = 0; i < 512; ++i)
+		chksum += (unsigned char)hdr[i];
+	snprintf(hdr + 148, 8, "%07lo", chksum);
+	if (fwrite(hdr, 1, 512, t->file) != 512)
+		fatal("write %s:", t->name);
+}
+
+static void
+writepad(struct tarout *t, off_t size)
+{
+	static const char zero[512];
+	size_t len;
+
+	len = -size & 511;
+	if (fwrite(zero, 1, len, t->file) != len)
+		fatal("write %s:", t->name);
+}
+
+static void
+writedata(struct tarout *t, int fd, const char *source, off_t off, off_t len)
+{
+	char buf[16384];
+	ssize_t ret;
+
+	while (len > 0) {
+		++t->syscalls;
+		ret = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), off);
+		if (ret < 0)
+			fatal("read %s:", source);
+		if (ret == 0)
+			fatal("file '%s' changed size when reading", source);
+		if (fwrite(buf, 1, ret, t->file) != ret)
+			fatal("write %s:", t->name);
+		t->copied += ret;
+		off += ret, len -= ret;
+	}
+}
+
+static void
+mapadd(struct tarout *t, size_t i, off_t off, off_t len)
+{
+	if (i == t->mapcap) {
+		t->mapcap = t->mapcap ? t->mapcap * 2 : 16;
+		t->map = reallocarray(t->map, t->mapcap, sizeof(t->map[0]));
+		if (!t->map)
+			fatal(NULL);
+	}
+	t->map[i].off = off;
+	t->map[i].len = len;
+}
+
+/*
+returns the number of data extents of a file with holes, or 0 if
+the file should be archived as a regular member
+*/
+static size_t
+sparsemap(struct tarout *t, int fd, const char *source, off_t size)
+{
+#ifdef SEEK_HOLE
+	off_t data, hole, total;
+	size_t n;
+
+	n = 0;
+	total = 0;
+	for (hole = 0; hole < size; ++n) {
+		++t->syscalls;
+		data = lseek(fd, hole, SEEK_DATA);
+		if (data < 0) {
+			if (errno == ENXIO)
+				break;
+			return 0;
+		}
+		if (data >= size)
+			break;
+		++t->syscalls;
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0)
+			fatal("seek %s:", source);
+		if (hole > size)
+			hole = size;
+		mapadd(t, n, data, hole - data);
+		total += hole - data;
+	}
+	if (total == size)
+		return 0;
+	/* a trailing hole is recorded as an empty extent at the end */
+	if (n == 0 || t->map[n - 1].off + t->map[n - 1].len < size)
+		mapadd(t, n++, size, 0);
+	return n;
+#else
+	return 0;
+#endif
+}
+
+/* switch phases, if the archive is written by the main thread */
+static int
+phase(struct tarout *t, int next)
+{
+	return t->main ? statphase(next) : next;
+}
+
+/* write a GNU PAX 1.0 sparse member, storing only the data extents */
+static void
+writesparse(struct tarout *t, char hdr[static 512], const char *name, int fd, const char *source, off_t size, size_t n)
+{
+	char xhdr[512], num[32];
+	const char *base;
+	off_t total;
+	size_t i;
+
+	t->extlen = 0;
+	paxrec(t, "GNU.sparse.major", "1");
+	paxrec(t, "GNU.sparse.minor", "0");
+	paxrec(t, "GNU.sparse.name", name);
+	snprintf(num, sizeof(num), "%jd", (intmax_t)size);
+	paxrec(t, "GNU.sparse.realsize", num);
+	inithdr(xhdr);
+	setname(xhdr, "././@PaxHeader", 14);
+	memcpy(xhdr + 100, "0000644", 7);
+	setsize(xhdr, name, t->extlen);
+	xhdr[156] = PAXTYPE;
+	writehdr(t, xhdr);
+	if (fwrite(t->ext, 1, t->extlen, t->file) != t->extlen)
+		fatal("write %s:", t->name);
+	writepad(t, t->extlen);
+
+	base = strrchr(name, '/');
+	assert(base);
+	t->extlen = 0;
+	extprintf(t, "%.*s/GNUSparseFile.0/%s", (int)(base - name), name, base + 1);
+	setname(hdr, t->ext, t->extlen);
+
+	t->extlen = 0;
+	extprintf(t, "%zu\n", n);
+	total = 0;
+	for (i = 0; i < n; ++i) {
+		extprintf(t, "%jd\n%jd\n", (intmax_t)t->map[i].off, (intmax_t)t->map[i].len);
+		total += t->map[i].len;
+	}
+	setsize(hdr, name, ((t->extlen + 511) & ~(off_t)511) + total);
+	writehdr(t, hdr);
+	if (fwrite(t->ext, 1, t->extlen, t->file) != t->extlen)
+		fatal("write %s:", t->name);
+	writepad(t, t->extlen);
+	phase(t, PHASEWRITE);
+	for (i = 0; i < n; ++i)
+		writedata(t, fd, source, t->map[i].off, t->map[i].len);
+	writepad(t, total);
+}
+
+static void
+fspec(struct tarout *t, char *pos, size_t reclen)
+{
+	const char *name, *mode = NULL, *source = NULL;
+	char hdr[512];
+	char *end;
+	size_t len, namelen, n;
+	int ret, fd, prev;
+	struct stat st;
+
+	inithdr(hdr);
+
+	/* name */
+	name = pos;
+	end = memchr(pos, '\n', reclen);
+	assert(end);
+	*end = 0;
+	namelen = end - pos;
+	reclen -= namelen + 1;
+	pos = end + 1;
+
+	for (; reclen > 0; pos = end + 1) {
+		end = memchr(pos, '\n', reclen);
+		assert(end);
+		*end = 0;
+		len = end - pos;
+		reclen -= len + 1;
+
+		if (len >= 5 && memcmp(pos, "type=", 5) == 0) {
+			pos += 5, len -= 5;
+			if (len == 3 && memcmp(pos, "reg", 3) == 0)
+				hdr[156] = REGTYPE;
+			else if (len == 3 && memcmp(pos, "sym", 3) == 0)
+				hdr[156] = SYMTYPE;
+			else if (len == 3 && memcmp(pos, "dir", 3) == 0)
+				hdr[156] = DIRTYPE;
+			else
+				fatal("file '%s' has unsupported type '%s'", name, pos);
+		} else if (len >= 5 && memcmp(pos, "mode=", 5) == 0) {
+			pos += 5, len -= 5;
+			if (len != 4 || !isodigit(pos[0]) || !isodigit(pos[1]) || !isodigit(pos[2]) || !isodigit(pos[3]))
+				fatal("file '%s' has invalid mode '%s'", name, pos);
+			mode = pos;
+		} else if (len >= 7 && memcmp(pos, "source=", 7) == 0) {
+			source = pos + 7;
+		} else if (len >= 7 && memcmp(pos, "target=", 7) == 0) {
+			pos += 7, len -= 7;
+			if (len > 100)
+				fatal("symlink '%s' target is too long", name);
+			memcpy(hdr + 157, pos, len);
+		} else if (len >= 4 && (memcmp(pos, "uid=", 4) == 0 || memcmp(pos, "gid=", 4) == 0)) {
+			const char *key;
+			unsigned long id;
+			int err;
+
+			key = pos;
+			pos[3] = 0;
+			pos += 4, len -= 4;
+			id = decnum(pos, len, &err);
+			if (err)
+				fatal("file '%s' has invalid %s '%s'", name, key, pos);
+			ret = snprintf(hdr + (key[0] == 'u' ? 108 : 116), 8, "%07lo", id);
+			if (ret < 0 || ret >= 8)
+				fatal("file '%s' uid is too large");
+		}
+	}
+	if (!hdr[156])
+		fatal("file '%s' is missing 'type' attribute", name);
+	if (!mode) {
+		switch (hdr[156]) {
+		case REGTYPE: mode = "0644"; break;
+		case SYMTYPE: mode = "0777"; break;
+		case DIRTYPE: mode = "0755"; break;
+		}
+	}
+
+	/* mode */
+	memset(hdr + 100, '0', 3);
+	memcpy(hdr + 100 + 3, mode, 4);
+
+	if (!source)
+		source = name + 1;
+	if (t->main)
+		tracerecord(name);
+	prev = phase(t, PHASEHEADER);
+	if (hdr[156] != REGTYPE) {
+		setname(hdr, name, namelen);
+		writehdr(t, hdr);
+		phase(t, prev);
+		if (t->main)
+			tracerecord("");
+		return;
+	}
+
+	phase(t, PHASESTAT);
+	++t->syscalls;
+	fd = open(source, O_RDONLY);
+	if (fd < 0)
+		fatal("open %s:", source);
+	++t->syscalls;
+	if (fstat(fd, &st) != 0)
+		fatal("stat %s:", source);
+	n = sparsemap(t, fd, source, st.st_size);
+	phase(t, PHASEHEADER);
+	if (n > 0) {
+		writesparse(t, hdr, name, fd, source, st.st_size, n);
+	} else {
+		setname(hdr, name, namelen);
+		setsize(hdr, name, st.st_size);
+		writehdr(t, hdr);
+		phase(t, PHASEWRITE);
+		writedata(t, fd, source, 0, st.st_size);
+		writepad(t, st.st_size);
+	}
+	++t->syscalls;
+	close(fd);
+	phase(t, prev);
+	if (t->main)
+		tracerecord("");
+}
+
+static void
+trailer(struct tarout *t)
+{
+	static const char zero[1024];
+
+	fwrite(zero, 1, sizeof(zero), t->file);
+	fflush(t->file);
+	if (ferror(t->file))
+		fatal("write %s:", t->name);
+}
+
+static void
+tarrecord(struct stage *s, char *pos, size_t len)
+{
+	fspec(&out, pos, len);
+}
+
+static void
+tarend(struct stage *s)
+{
+	phase(&out, PHASEWRITE);
+	trailer(&out);
+	stats[STATSYSCALLS] += out.syscalls;
+	stats[STATCOPIED] += out.copied;
+}
+
+/* a sink that writes the records to stdout as a ustar archive */
+struct stage *
+tarstage(void)
+{
+	static struct stage s = {tarrecord, tarend};
+
+	out.file = stdout;
+	out.name = "stdout";
+	out.main = 1;
+	return &s;
+}
+
+static void *
+grow(void *p, size_t *max, size_t need, size_t size)
+{
+	if (need <= *max)
+		return p;
+	*max = need > *max * 2 ? need : *max * 2;
+	p = reallocarray(p, *max, size);
+	if (!p)
+		fatal(NULL);
+	return p;
+}
+
+/* fill in the name length, type, and archive bytes of a record, from its size attribute or the source file */
+static void
+weigh(struct rec *r)
+{
+	const char *pos, *line, *end, *size = NULL, *source = NULL;
+	char *path;
+	size_t sizelen = 0, sourcelen = 0;
+	unsigned long n;
+	int reg = 0, err;
+	struct stat st;
+
+	pos = buf + r->off;
+	end = memchr(pos, '\n', r->len);
+	r->namelen = end - pos;
+	for (line = end + 1; line < pos + r->len; line = end + 1) {
+		end = memchr(line, '\n', pos + r->len - line);
+		if (end - line == 8 && memcmp(line, "type=reg", 8) == 0)
+			reg = 1;
+		else if (end - line == 8 && memcmp(line, "type=dir", 8) == 0)
+			r->dir = 1;
+		else if (end - line >= 5 && memcmp(line, "size=", 5) == 0)
+			size = line + 5, sizelen = end - size;
+		else if (end - line >= 7 && memcmp(line, "source=", 7) == 0)
+			source = line + 7, sourcelen = end - source;
+	}
+	r->weight = 512;
+	if (!reg)
+		return;
+	if (size) {
+		n = decnum(size, sizelen, &err);
+		if (!err) {
+			r->weight += (n + 511) & ~511ul;
+			return;
+		}
+	}
+	if (!source)
+		source = pos + 1, sourcelen = r->namelen - 1;
+	path = strndup(source, sourcelen);
+	if (!path)
+		fatal(NULL);
+	++stats[STATSYSCALLS];
+	if (stat(path, &st) != 0)
+		fatal("stat %s:", path);
+	r->weight += (st.st_size + 511) & ~(off_t)511;
+	free(path);
+}
+
+/* whether record i is below directory record j */
+static int
+below(size_t i, size_t j)
+{
+	struct rec *r = &recs[i], *d = &recs[j];
+
+	if (d->namelen == 1)
+		return r->namelen > 1;
+	return r->namelen > d->namelen && memcmp(buf + r->off, buf + d->off, d->namelen) == 0 && buf[r->off + d->namelen] == '/';
+}
+
+static void *
+shardmain(void *arg)
+{
+	struct shard *sh = arg;
+	char *rec = NULL;
+	size_t i, j, n, recmax = 0;
+	long long start = 0;
+
+	if (tracing)
+		start = tracenow();
+	/* repeat the ancestor directories so the shard extracts on its own */
+	n = sh->first < sh->last ? sh->ndirs : 0;
+	for (i = 0; i < n + sh->last - sh->first; ++i) {
+		j = i < n ? sh->dirs[i] : sh->first + i - n;
+		rec = grow(rec, &recmax, recs[j].len, 1);
+		memcpy(rec, buf + recs[j].off, recs[j].len);
+		fspec(&sh->out, rec, recs[j].len);
+	}
+	trailer(&sh->out);
+	free(rec);
+	if (tracing)
+		tracespan(PHASEWRITE, sh->out.name, start, tracenow());
+	return NULL;
+}
+
+static void
+shardrecord(struct stage *s, char *pos, size_t len)
+{
+	struct rec *r;
+
+	buf = grow(buf, &bufmax, buflen + len, 1);
+	recs = grow(recs, &recsmax, nrecs + 1, sizeof(recs[0]));
+	r = &recs[nrecs++];
+	memset(r, 0, sizeof(*r));
+	r->off = buflen;
+	r->len = len;
+	memcpy(buf + buflen, pos, len);
+	buflen += len;
+}
+
+static void
+shardend(struct stage *s)
+{
+	struct shard *sh;
+	const char *base;
+	size_t i, k, *stack, depth;
+	uintmax_t total, sum;
+	off_t size;
+
+	statphase(PHASESTAT);
+	total = 0;
+	for (i = 0; i < nrecs; ++i) {
+		weigh(&recs[i]);
+		total += recs[i].weight;
+	}
+
+	/* cut the records into ranges of about equal bytes */
+	stack = reallocarray(NULL, nrecs, sizeof(stack[0]));
+	if (!stack && nrecs > 0)
+		fatal(NULL);
+	depth = 0;
+	sum = 0;
+	for (i = 0, k = 0; i < nrecs; ++i) {
+		while (depth > 0 && !below(i, stack[depth - 1]))
+			--depth;
+		for (; k < nshards && sum * nshards >= total * k; ++k) {
+			sh = &shards[k];
+			sh->first = i;
+			sh->dirs = reallocarray(NULL, depth, sizeof(sh->dirs[0]));
+			if (!sh->dirs && depth > 0)
+				fatal(NULL);
+			memcpy(sh->dirs, stack, depth * sizeof(stack[0]));
+			sh->ndirs = depth;
+		}
+		if (recs[i].dir)
+			stack[depth++] = i;
+		sum += recs[i].weight;
+	}
+	free(stack);
+	for (; k < nshards; ++k)
+		shards[k].first = nrecs;
+	for (k = 0; k < nshards; ++k)
+		shards[k].last = k + 1 < nshards ? shards[k + 1].first : nrecs;
+
+	statphase(PHASEWRITE);
+	for (k = 0; k < nshards; ++k) {
+		if (pthread_create(&shards[k].tid, NULL, shardmain, &shards[k]) != 0)
+			fatal("pthread_create:");
+	}
+	for (k = 0; k < nshards; ++k) {
+		sh = &shards[k];
+		pthread_join(sh->tid, NULL);
+		stats[STATSYSCALLS] += sh->out.syscalls;
+		stats[STATCOPIED] += sh->out.copied;
+		size = ftello(sh->out.file);
+		if (size < 0)
+			fatal("tell %s:", sh->out.name);
+		if (fclose(sh->out.file) != 0)
+			fatal("close %s:", sh->out.name);
+		base = strrchr(sh->out.name, '/');
+		base = base ? base + 1 : sh->out.name;
+		printf("/%s\ntype=reg\nmode=0644\nsize=%jd\nsource=%s\n\n", base, (intmax_t)size, sh->out.name);
+	}
+	fflush(stdout);
+	if (ferror(stdout))
+		fatal("write:");
+}
+
+/*
+a sink that writes the records as n self-contained archives prefix.K.tar
+of about equal size, in parallel, then a manifest of the archives to stdout;
+the records are held until the end, and keep their order within each archive
+*/
+struct stage *
+shardstage(const char *prefix, size_t n)
+{
+	static struct stage s = {shardrecord, shardend};
+	struct shard *sh;
+	size_t k, width;
+	char *name;
+	int len;
+
+	nshards = n;
+	shards = calloc(n, sizeof(shards[0]));
+	if (!shards)
+		fatal(NULL);
+	for (width = 1, k = n - 1; k >= 10; k /= 10)
+		++width;
+	for (k = 0; k < n; ++k) {
+		sh = &shards[k];
+		len = snprintf(NULL, 0, "%s.%0*zu.tar", prefix, (int)width, k);
+		name = malloc(len + 1);
+		if (!name)
+			fatal(NULL);
+		snprintf(name, len + 1, "%s.%0*zu.tar", prefix, (int)width, k);
+		sh->out.name = name;
+		sh->out.file = fopen(sh->out.name, "w");
+		if (!sh->out.file)
+			fatal("open %s:", sh->out.name);
+	}
+	return &s;
+}
@@ -0,0 +1,32 @@
+#!/bin/sh
+# usage: tree.sh workdir
+# Checks that tree digests are refused for a manifest that is not sorted,
+# and are computed for the same manifest once it is.
+
+set -e
+
+bin=$(cd "$(dirname "$0")/.." && pwd)
+work=$1
+
+rm -rf "$work"
+mkdir -p "$work"
+cd "$work"
+
+"$bin/bench/gentree" -n 200 -f 4 -d 2 -r 1 src >raw
+
+# reverse the records, so every file comes before its directory
+awk 'BEGIN { RS = ""; ORS = "\n\n" } { r[NR] = $0 } END { for (i = NR; i > 0; --i) print r[i] }' raw >shuffled
+
+if "$bin/fspec-hash" -m <shuffled >out 2>err; then
+	echo "fspec-hash -m accepted unsorted input" >&2
+	exit 1
+fi
+grep -q -e 'not sorted' -e 'missing directory' err || {
+	echo "fspec-hash -m failed for another reason:" >&2
+	cat err >&2
+	exit 1
+}
+
+"$bin/fspec-sort" <shuffled | "$bin/fspec-hash" -m >out
+grep -q '^tree=' out
+echo ok
@@ -0,0 +1,246 @@
+#define _GNU_SOURCE /* for syscall */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "common.h"
+
+enum {
+	NBUCKETS = 32,
+	RINGLEN = 16384,
+};
+
+/* a span; a long name keeps its end, which names the file */
+struct event {
+	long long start, end;
+	int phase;
+	char name[108];
+};
+
+/*
+events are appended only by the owning thread, so recording takes no locks;
+the ring keeps the latest spans, and the histograms count every span
+*/
+struct tracebuf {
+	struct tracebuf *next;
+	long tid;
+	struct event *ring;
+	unsigned long long len;
+	unsigned long long hist[NPHASES][NBUCKETS], count[NPHASES];
+	long long total[NPHASES];
+};
+
+int tracing;
+
+static FILE *tracefile;
+static const char *tracename = "";
+static pthread_key_t key;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tracebuf *bufs;
+
+void
+traceinit(const char *name)
+{
+	tracefile = fopen(name, "w");
+	if (!tracefile)
+		fatal("open %s:", name);
+	if (pthread_key_create(&key, NULL) != 0)
+		fatal("pthread_key_create:");
+	tracing = 1;
+}
+
+long long
+tracenow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+const char *
+tracerecord(const char *name)
+{
+	const char *old;
+
+	old = tracename;
+	tracename = name;
+	return old;
+}
+
+static struct tracebuf *
+threadbuf(void)
+{
+	struct tracebuf *b;
+
+	b = pthread_getspecific(key);
+	if (b)
+		return b;
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		fatal(NULL);
+	b->ring = reallocarray(NULL, RINGLEN, sizeof(b->ring[0]));
+	if (!b->ring)
+		fatal(NULL);
+	b->tid = syscall(SYS_gettid);
+	if (pthread_setspecific(key, b) != 0)
+		fatal("pthread_setspecific:");
+	pthread_mutex_lock(&lock);
+	b->next = bufs;
+	bufs = b;
+	pthread_mutex_unlock(&lock);
+	return b;
+}
+
+void
+tracespan(int phase, const char *name, long long start, long long end)
+{
+	struct tracebuf *b;
+	struct event *e;
+	long long dur;
+	size_t len;
+	int j;
+
+	if (!tracing)
+		return;
+	b = threadbuf();
+	dur = end - start;
+	for (j = 0; j < NBUCKETS - 1 && dur >= 1000LL << j; ++j)
+		;
+	++b->hist[phase][j];
+	++b->count[phase];
+	b->total[phase] += dur;
+
+	e = &b->ring[b->len++ % RINGLEN];
+	e->phase = phase;
+	e->start = start;
+	e->end = end;
+	len = strlen(name);
+	if (len < sizeof(e->name)) {
+		memcpy(e->name, name, len + 1);
+	} else {
+		name += len - (sizeof(e->name) - 4);
+		/* do not start in the middle of a UTF-8 sequence */
+		while ((*name & 0xc0) == 0x80)
+			++name;
+		memcpy(e->name, "...", 3);
+		memcpy(e->name + 3, name, strlen(name) + 1);
+	}
+}
+
+void
+tracephase(int phase, long long start, long long end)
+{
+	if (phase != PHASEOTHER && phase != PHASEPARSE)
+		tracespan(phase, tracename, start, end);
+}
+
+/* the length of the valid UTF-8 sequence at s, or 0 */
+static int
+utf8len(const unsigned char *s)
+{
+	int n, i;
+
+	if (s[0] < 0x80)
+		return 1;
+	if (s[0] < 0xc2)
+		return 0;
+	n = s[0] < 0xe0 ? 2 : s[0] < 0xf0 ? 3 : s[0] < 0xf5 ? 4 : 0;
+	for (i = 1; i < n; ++i) {
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+	}
+	/* overlong forms, surrogates, and code points past U+10FFFF */
+	if ((s[0] == 0xe0 && s[1] < 0xa0) || (s[0] == 0xed && s[1] >= 0xa0)
+	 || (s[0] == 0xf0 && s[1] < 0x90) || (s[0] == 0xf4 && s[1] >= 0x90))
+		return 0;
+	return n;
+}
+
+/* file names need not be UTF-8; other bytes are written as the code point of the same value */
+static void
+jsonstr(const char *s)
+{
+	const unsigned char *p;
+	int n;
+
+	fputc('"', tracefile);
+	for (p = (const unsigned char *)s; *p; p += n) {
+		n = utf8len(p);
+		if (n == 0) {
+			fprintf(tracefile, "\\u%04x", *p);
+			n = 1;
+		} else if (*p == '"' || *p == '\\') {
+			fprintf(tracefile, "\\%c", *p);
+		} else if (*p < 0x20) {
+			fprintf(tracefile, "\\u%04x", *p);
+		} else {
+			fwrite(p, 1, n, tracefile);
+		}
+	}
+	fputc('"', tracefile);
+}
+
+/* write the recorded spans, followed by a log2 latency histogram of each phase */
+void
+tracewrite(void)
+{
+	struct tracebuf *b;
+	struct event *e;
+	unsigned long long hist[NPHASES][NBUCKETS] = {{0}}, count[NPHASES] = {0}, n, dropped = 0;
+	long long total[NPHASES] = {0};
+	const char *sep = "";
+	long pid;
+	int i, j;
+
+	if (!tracefile)
+		return;
+	statphase(PHASEOTHER);
+	pid = getpid();
+	fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", tracefile);
+	for (b = bufs; b; b = b->next) {
+		n = b->len < RINGLEN ? 0 : b->len - RINGLEN;
+		dropped += n;
+		for (; n < b->len; ++n) {
+			e = &b->ring[n % RINGLEN];
+			fprintf(tracefile, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%ld,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"path\":",
+				sep, phasenames[e->phase], pid, b->tid, e->start / 1e3, (e->end - e->start) / 1e3);
+			jsonstr(e->name);
+			fputs("}}", tracefile);
+			sep = ",\n";
+		}
+		for (i = 0; i < NPHASES; ++i) {
+			for (j = 0; j < NBUCKETS; ++j)
+				hist[i][j] += b->hist[i][j];
+			count[i] += b->count[i];
+			total[i] += b->total[i];
+		}
+	}
+	fprintf(tracefile, "\n],\"metadata\":{\"dropped\":%llu,\"histograms\":{", dropped);
+	sep = "";
+	for (i = 0; i < NPHASES; ++i) {
+		if (count[i] == 0)
+			continue;
+		fprintf(tracefile, "%s\n\"%s\":{\"count\":%llu,\"total_us\":%.3f,\"buckets_us\":{", sep, phasenames[i], count[i], total[i] / 1e3);
+		sep = "";
+		for (j = 0; j < NBUCKETS; ++j) {
+			if (hist[i][j] == 0)
+				continue;
+			/* the last bucket holds everything longer */
+			if (j == NBUCKETS - 1)
+				fprintf(tracefile, "%s\">=%lld\":%llu", sep, 1LL << (j - 1), hist[i][j]);
+			else
+				fprintf(tracefile, "%s\"<%lld\":%llu", sep, 1LL << j, hist[i][j]);
+			sep = ",";
+		}
+		fputs("}}", tracefile);
+		sep = ",";
+	}
+	fputs("\n}}}\n", tracefile);
+	fflush(tracefile);
+	if (ferror(tracefile))
+		fatal("write trace:");
+}
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <blake3.h>
+#include "common.h"
+
+struct rec {
+	size_t off, len;
+};
+
+struct open {
+	size_t rec, namelen;
+	blake3_hasher ctx;
+};
+
+static char *buf;
+static size_t buflen, bufmax;
+static struct rec *recs;
+static size_t nrecs, recsmax;
+static struct open *stack;
+static size_t depth, stackmax;
+static char *prev;
+static size_t prevmax;
+
+static void *
+grow(void *p, size_t *max, size_t need, size_t size)
+{
+	if (need <= *max)
+		return p;
+	*max = need > *max * 2 ? need : *max * 2;
+	p = reallocarray(p, *max, size);
+	if (!p)
+		fatal(NULL);
+	return p;
+}
+
+/* finish the innermost directory: fill in its digest and add its record to the parent */
+static void
+treeclose(void)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char hash[BLAKE3_OUT_LEN];
+	struct open *o;
+	struct rec *r;
+	char *pos;
+	size_t i;
+
+	o = &stack[--depth];
+	blake3_hasher_finalize(&o->ctx, hash, sizeof(hash));
+	r = &recs[o->rec];
+	pos = buf + r->off + r->len - (6 + 2 * sizeof(hash));
+	memcpy(pos, "tree=", 5);
+	for (i = 0, pos += 5; i < sizeof(hash); ++i, pos += 2) {
+		pos[0] = hex[hash[i] >> 4];
+		pos[1] = hex[hash[i] & 0xf];
+	}
+	*pos = '\n';
+	if (depth > 0) {
+		blake3_hasher_update(&stack[depth - 1].ctx, buf + r->off, r->len);
+		blake3_hasher_update(&stack[depth - 1].ctx, "\n", 1);
+	}
+}
+
+static void
+treerecord(struct stage *s, char *pos, size_t len)
+{
+	struct open *o;
+	struct rec *r;
+	char *line, *end;
+	size_t namelen;
+	int isdir = 0;
+
+	end = memchr(pos, '\n', len);
+	namelen = end - pos;
+
+	/* a digest is only right if each directory's records follow it in order */
+	*end = '\0';
+	checkpath(prev ? prev : "", pos);
+	prev = grow(prev, &prevmax, namelen + 1, 1);
+	memcpy(prev, pos, namelen + 1);
+	*end = '\n';
+
+	for (; depth > 0; treeclose()) {
+		o = &stack[depth - 1];
+		if (o->namelen == 1 ? namelen > 1 : namelen > o->namelen && memcmp(pos, buf + recs[o->rec].off, o->namelen) == 0 && pos[o->namelen] == '/')
+			break;
+	}
+
+	/* copy the record, dropping any digest from an earlier run */
+	buf = grow(buf, &bufmax, buflen + len + 6 + 2 * BLAKE3_OUT_LEN, 1);
+	recs = grow(recs, &recsmax, nrecs + 1, sizeof(recs[0]));
+	r = &recs[nrecs];
+	r->off = buflen;
+	for (line = pos; line < pos + len; line = end + 1) {
+		end = memchr(line, '\n', pos + len - line);
+		if (end - line >= 5 && memcmp(line, "tree=", 5) == 0)
+			continue;
+		if (end - line == 8 && memcmp(line, "type=dir", 8) == 0)
+			isdir = 1;
+		memcpy(buf + buflen, line, end + 1 - line);
+		buflen += end + 1 - line;
+	}
+	if (isdir) {
+		buflen += 6 + 2 * BLAKE3_OUT_LEN;
+		stack = grow(stack, &stackmax, depth + 1, sizeof(stack[0]));
+		o = &stack[depth++];
+		o->rec = nrecs;
+		o->namelen = namelen;
+		blake3_hasher_init(&o->ctx);
+	}
+	r->len = buflen - r->off;
+	if (!isdir && depth > 0) {
+		blake3_hasher_update(&stack[depth - 1].ctx, buf + r->off, r->len);
+		blake3_hasher_update(&stack[depth - 1].ctx, "\n", 1);
+	}
+	++nrecs;
+}
+
+static void
+treeend(struct stage *s)
+{
+	size_t i;
+
+	while (depth > 0)
+		treeclose();
+	for (i = 0; i < nrecs; ++i)
+		s->next->record(s->next, buf + recs[i].off, recs[i].len);
+	s->next->end(s->next);
+}
+
+/*
+ * a filter that gives each directory a tree attribute: the BLAKE3 of its
+ * child records in order, each followed by its blank line; the records must
+ * be sorted, and are held until the end since a digest depends on everything below
+ */
+struct stage *
+treestage(struct stage *next)
+{
+	static struct stage s = {treerecord, treeend};
+
+	s.next = next;
+	return &s;
+}
@@ -0,0 +1,200 @@
+#define _GNU_SOURCE /* for struct statx */
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "common.h"
+
+#if defined(__linux__) && defined(__ATOMIC_ACQUIRE) && defined(SYS_io_uring_setup)
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sqlocal, queued;
+};
+
+struct uring *
+uringnew(unsigned entries)
+{
+	struct io_uring_params p;
+	struct uring *r;
+	size_t sqsize, cqsize;
+	char *sq, *cq;
+
+	r = malloc(sizeof(*r));
+	if (!r)
+		fatal(NULL);
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(SYS_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		goto err0;
+	sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP && cqsize > sqsize)
+		sqsize = cqsize;
+	sq = mmap(NULL, sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto err1;
+	cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto err1;
+	}
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto err1;
+	r->sqhead = (unsigned *)(sq + p.sq_off.head);
+	r->sqtail = (unsigned *)(sq + p.sq_off.tail);
+	r->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sqarray = (unsigned *)(sq + p.sq_off.array);
+	r->cqhead = (unsigned *)(cq + p.cq_off.head);
+	r->cqtail = (unsigned *)(cq + p.cq_off.tail);
+	r->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->sqlocal = *r->sqtail;
+	r->queued = 0;
+	return r;
+
+err1:
+	/* the mappings are released with the process; the ring is unusable either way */
+	close(r->fd);
+err0:
+	free(r);
+	return NULL;
+}
+
+static struct io_uring_sqe *
+sqe(struct uring *r, int op, void *data)
+{
+	struct io_uring_sqe *e;
+	unsigned head;
+
+	head = __atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE);
+	if (r->sqlocal - head > *r->sqmask)
+		return NULL;
+	e = &r->sqes[r->sqlocal & *r->sqmask];
+	memset(e, 0, sizeof(*e));
+	e->opcode = op;
+	e->user_data = (uintptr_t)data;
+	r->sqarray[r->sqlocal & *r->sqmask] = r->sqlocal & *r->sqmask;
+	++r->sqlocal;
+	++r->queued;
+	__atomic_store_n(r->sqtail, r->sqlocal, __ATOMIC_RELEASE);
+	return e;
+}
+
+int
+uringstatx(struct uring *r, void *data, int dirfd, const char *name, int flags, unsigned mask, struct statx *stx)
+{
+	struct io_uring_sqe *e;
+
+	e = sqe(r, IORING_OP_STATX, data);
+	if (!e)
+		return -1;
+	e->fd = dirfd;
+	e->addr = (uintptr_t)name;
+	e->len = mask;
+	e->off = (uintptr_t)stx;
+	e->statx_flags = flags;
+	return 0;
+}
+
+int
+uringopenat(struct uring *r, void *data, int dirfd, const char *name, int flags)
+{
+	struct io_uring_sqe *e;
+
+	e = sqe(r, IORING_OP_OPENAT, data);
+	if (!e)
+		return -1;
+	e->fd = dirfd;
+	e->addr = (uintptr_t)name;
+	e->open_flags = flags;
+	return 0;
+}
+
+int
+uringread(struct uring *r, void *data, int fd, void *buf, size_t len, off_t off)
+{
+	struct io_uring_sqe *e;
+
+	e = sqe(r, IORING_OP_READ, data);
+	if (!e)
+		return -1;
+	e->fd = fd;
+	e->addr = (uintptr_t)buf;
+	e->len = len;
+	e->off = off;
+	return 0;
+}
+
+int
+uringwait(struct uring *r, void **data, int *res)
+{
+	struct io_uring_cqe *e;
+	unsigned head;
+	int ret;
+
+	for (;;) {
+		head = *r->cqhead;
+		if (head != __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE))
+			break;
+		++stats[STATSYSCALLS];
+		ret = syscall(SYS_io_uring_enter, r->fd, r->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		r->queued -= ret;
+	}
+	e = &r->cqes[head & *r->cqmask];
+	*data = (void *)(uintptr_t)e->user_data;
+	*res = e->res;
+	__atomic_store_n(r->cqhead, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+#else
+
+struct uring *
+uringnew(unsigned entries)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+int
+uringstatx(struct uring *r, void *data, int dirfd, const char *name, int flags, unsigned mask, struct statx *stx)
+{
+	return -1;
+}
+
+int
+uringopenat(struct uring *r, void *data, int dirfd, const char *name, int flags)
+{
+	return -1;
+}
+
+int
+uringread(struct uring *r, void *data, int fd, void *buf, size_t len, off_t off)
+{
+	return -1;
+}
+
+int
+uringwait(struct uring *r, void **data, int *res)
+{
+	return -1;
+}
+
+#endif
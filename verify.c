@@ -0,0 +1,477 @@
+#define _XOPEN_SOURCE 700 /* for drand48 */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <blake3.h>
+#include "common.h"
+
+enum {
+	WINDOW = 1024,
+};
+
+/* a difference waiting to be printed in manifest order, or a file waiting to be hashed */
+struct slot {
+	char *name;
+	char hash[2 * BLAKE3_OUT_LEN];
+	char msg[80];
+	int job, done;
+	unsigned long long hashed, syscalls;
+};
+
+struct dir {
+	int fd, complete;
+	char *name, **ent;
+	size_t namelen, pos, len;
+	struct dir *next;
+};
+
+static char *root, *prev;
+static size_t prevmax;
+static int rootfd = -1;
+static struct dir *dir;
+static double rate;
+static unsigned long long ndiffs;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	struct slot slot[WINDOW];
+	size_t head, next, tail; /* next to print, next to hash, next to fill */
+} win = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static void
+hashfile(struct slot *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	blake3_hasher ctx;
+	unsigned char hash[BLAKE3_OUT_LEN];
+	char buf[65536];
+	ssize_t ret;
+	size_t i;
+	int fd;
+
+	++s->syscalls;
+	fd = openat(rootfd, s->name + 1, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		snprintf(s->msg, sizeof(s->msg), "error: %s", strerror(errno));
+		return;
+	}
+	blake3_hasher_init(&ctx);
+	while (++s->syscalls, (ret = read(fd, buf, sizeof(buf))) > 0) {
+		blake3_hasher_update(&ctx, buf, ret);
+		s->hashed += ret;
+	}
+	if (ret < 0)
+		snprintf(s->msg, sizeof(s->msg), "error: %s", strerror(errno));
+	close(fd);
+	if (ret < 0)
+		return;
+	blake3_hasher_finalize(&ctx, hash, sizeof(hash));
+	for (i = 0; i < sizeof(hash); ++i) {
+		if (s->hash[2 * i] != hex[hash[i] >> 4] || s->hash[2 * i + 1] != hex[hash[i] & 0xf]) {
+			snprintf(s->msg, sizeof(s->msg), "blake3 differs");
+			break;
+		}
+	}
+}
+
+static void *
+worker(void *arg)
+{
+	struct slot *s;
+	long long start = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&win.lock);
+		for (;;) {
+			/* slots without a job are done at once, so drain() may have passed and reused them */
+			if (win.next < win.head)
+				win.next = win.head;
+			while (win.next < win.tail && !win.slot[win.next % WINDOW].job)
+				++win.next;
+			if (win.next < win.tail)
+				break;
+			pthread_cond_wait(&win.work, &win.lock);
+		}
+		s = &win.slot[win.next++ % WINDOW];
+		s->job = 0;
+		pthread_mutex_unlock(&win.lock);
+		if (tracing)
+			start = tracenow();
+		hashfile(s);
+		if (tracing)
+			tracespan(PHASEHASH, s->name, start, tracenow());
+		pthread_mutex_lock(&win.lock);
+		s->done = 1;
+		pthread_cond_signal(&win.done);
+		pthread_mutex_unlock(&win.lock);
+	}
+	return NULL;
+}
+
+/* print finished slots in order until at most keep are left */
+static void
+drain(size_t keep)
+{
+	struct slot *s;
+	int phase;
+
+	pthread_mutex_lock(&win.lock);
+	while (win.tail - win.head > keep) {
+		s = &win.slot[win.head % WINDOW];
+		if (!s->done) {
+			phase = statphase(PHASEHASH);
+			while (!s->done)
+				pthread_cond_wait(&win.done, &win.lock);
+			statphase(phase);
+		}
+		if (s->msg[0]) {
+			printf("%-48s %s\n", s->name, s->msg);
+			++ndiffs;
+			++stats[STATMISMATCHED];
+		}
+		stats[STATHASHED] += s->hashed;
+		stats[STATSYSCALLS] += s->syscalls;
+		free(s->name);
+		++win.head;
+	}
+	pthread_mutex_unlock(&win.lock);
+}
+
+static struct slot *
+slotnew(const char *dirname, const char *name)
+{
+	struct slot *s;
+	size_t len;
+
+	drain(WINDOW - 1);
+	s = &win.slot[win.tail % WINDOW];
+	len = dirname ? strlen(dirname) : 0;
+	s->name = malloc(len + strlen(name) + 2);
+	if (!s->name)
+		fatal(NULL);
+	if (dirname)
+		sprintf(s->name, "%s/%s", strcmp(dirname, "/") == 0 ? "" : dirname, name);
+	else
+		strcpy(s->name, name);
+	s->msg[0] = '\0';
+	s->job = 0;
+	s->done = 1;
+	s->hashed = 0;
+	s->syscalls = 0;
+	return s;
+}
+
+static void
+slotadd(struct slot *s)
+{
+	pthread_mutex_lock(&win.lock);
+	++win.tail;
+	if (s->job)
+		pthread_cond_signal(&win.work);
+	pthread_mutex_unlock(&win.lock);
+}
+
+static void
+report(const char *dirname, const char *name, const char *fmt, ...)
+{
+	struct slot *s;
+	va_list ap;
+
+	s = slotnew(dirname, name);
+	va_start(ap, fmt);
+	vsnprintf(s->msg, sizeof(s->msg), fmt, ap);
+	va_end(ap);
+	slotadd(s);
+}
+
+static int
+entcmp(const void *p1, const void *p2)
+{
+	return pathcmp(*(char **)p1, *(char **)p2, NULL);
+}
+
+/* push a directory of the tree, listing it in manifest order if it is to be checked for extra files */
+static void
+dirpush(int fd, const char *name, int scan)
+{
+	struct dir *d;
+	struct dirent *ent;
+	DIR *dp;
+	size_t entmax = 0;
+	int dfd, phase;
+
+	d = malloc(sizeof(*d));
+	if (!d)
+		fatal(NULL);
+	d->fd = fd;
+	d->complete = fd == -1 || scan;
+	d->name = strdup(name);
+	if (!d->name)
+		fatal(NULL);
+	d->namelen = strcmp(name, "/") == 0 ? 0 : strlen(name);
+	d->ent = NULL;
+	d->pos = 0;
+	d->len = 0;
+	d->next = dir;
+	dir = d;
+	if (fd == -1 || !scan)
+		return;
+	phase = statphase(PHASESCANDIR);
+	stats[STATSYSCALLS] += 3;
+	dfd = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0 || !(dp = fdopendir(dfd)))
+		fatal("open %s%s:", root, name);
+	while (errno = 0, (ent = readdir(dp))) {
+		const char *n = ent->d_name;
+
+		if (n[0] == '.' && (!n[1] || (n[1] == '.' && !n[2])))
+			continue;
+		if (d->len == entmax) {
+			entmax = entmax ? entmax * 2 : 64;
+			d->ent = reallocarray(d->ent, entmax, sizeof(d->ent[0]));
+			if (!d->ent)
+				fatal(NULL);
+		}
+		d->ent[d->len] = strdup(n);
+		if (!d->ent[d->len])
+			fatal(NULL);
+		++d->len;
+	}
+	if (errno)
+		fatal("readdir %s%s:", root, name);
+	closedir(dp);
+	qsort(d->ent, d->len, sizeof(d->ent[0]), entcmp);
+	statphase(phase);
+}
+
+/* report the remaining entries of the innermost directory as extra, and close it */
+static void
+dirpop(void)
+{
+	struct dir *d;
+
+	d = dir;
+	for (; d->pos < d->len; ++d->pos)
+		report(d->name, d->ent[d->pos], "extra");
+	while (d->len > 0)
+		free(d->ent[--d->len]);
+	free(d->ent);
+	free(d->name);
+	if (d->fd >= 0)
+		close(d->fd);
+	dir = d->next;
+	free(d);
+}
+
+static const char *
+typename(mode_t mode)
+{
+	switch (mode & S_IFMT) {
+	case S_IFREG: return "reg";
+	case S_IFDIR: return "dir";
+	case S_IFLNK: return "sym";
+	}
+	return "other";
+}
+
+static void
+verifyrecord(struct stage *stage, char *pos, size_t len)
+{
+	struct slot *s;
+	struct stat st;
+	char *name, *end, *target = NULL, *hash = NULL, *buf;
+	const char *base;
+	mode_t mode = 0;
+	off_t size = -1;
+	size_t n;
+	ssize_t ret;
+	int fd, cmp = 1, phase;
+
+	name = pos;
+	end = memchr(pos, '\n', len);
+	*end = '\0';
+	len -= end + 1 - pos;
+	pos = end + 1;
+	checkpath(prev ? prev : "", name);
+	tracerecord(name);
+	n = end - name + 1;
+	if (n > prevmax) {
+		prevmax = n > prevmax * 2 ? n : prevmax * 2;
+		prev = realloc(prev, prevmax);
+		if (!prev)
+			fatal(NULL);
+	}
+	memcpy(prev, name, n);
+
+	for (; len > 0; pos = end + 1) {
+		end = memchr(pos, '\n', len);
+		*end = '\0';
+		len -= end + 1 - pos;
+		if (strncmp(pos, "type=", 5) == 0) {
+			pos += 5;
+			if (strcmp(pos, "reg") == 0)
+				mode = (mode & ~S_IFMT) | S_IFREG;
+			else if (strcmp(pos, "sym") == 0)
+				mode = (mode & ~S_IFMT) | S_IFLNK;
+			else if (strcmp(pos, "dir") == 0)
+				mode = (mode & ~S_IFMT) | S_IFDIR;
+			else
+				fatal("file '%s' has unsupported type '%s'", name, pos);
+		} else if (strncmp(pos, "mode=", 5) == 0) {
+			pos += 5;
+			mode = (mode & S_IFMT) | strtoul(pos, &end, 8);
+			if (*end)
+				fatal("file '%s' has unsupported mode '%s'", name, pos);
+		} else if (strncmp(pos, "size=", 5) == 0) {
+			pos += 5;
+			size = strtoull(pos, &end, 10);
+			if (*end)
+				fatal("file '%s' has unsupported size '%s'", name, pos);
+		} else if (strncmp(pos, "target=", 7) == 0) {
+			target = pos + 7;
+		} else if (strncmp(pos, "blake3=", 7) == 0) {
+			hash = pos + 7;
+			if (end - hash != 2 * BLAKE3_OUT_LEN)
+				fatal("file '%s' has invalid blake3 attribute", name);
+		}
+	}
+	if (!(mode & S_IFMT))
+		fatal("file '%s' is missing type", name);
+
+	while (dir && !(dir->namelen == 0 || (strncmp(name, dir->name, dir->namelen) == 0 && name[dir->namelen] == '/')))
+		dirpop();
+	if (strcmp(name, "/") == 0) {
+		fd = AT_FDCWD;
+		base = root;
+	} else {
+		if (!dir) {
+			/* no root entry, so only check the tree below it */
+			fd = dup(rootfd);
+			if (fd < 0)
+				fatal("dup:");
+			dirpush(fd, "/", 0);
+		}
+		base = strrchr(name, '/');
+		if (base - name != dir->namelen)
+			fatal("file '%s' is not in a directory", name);
+		++base;
+		fd = dir->fd;
+		if (dir->complete) {
+			while (dir->pos < dir->len && (cmp = pathcmp(dir->ent[dir->pos], base, NULL)) < 0)
+				report(dir->name, dir->ent[dir->pos++], "extra");
+			if (cmp == 0)
+				++dir->pos;
+			else
+				fd = -1;
+		}
+	}
+
+	phase = statphase(PHASESTAT);
+	if (fd == -1) {
+		st.st_mode = 0;
+	} else if (++stats[STATSYSCALLS], fstatat(fd, base, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+		if (errno != ENOENT)
+			fatal("lstat %s:", name);
+		st.st_mode = 0;
+	}
+	if (!st.st_mode) {
+		report(NULL, name, "missing");
+	} else if ((st.st_mode & S_IFMT) != (mode & S_IFMT)) {
+		report(NULL, name, "type %s, expected %s", typename(st.st_mode), typename(mode));
+		st.st_mode = 0;
+	} else {
+		if (!S_ISLNK(mode) && (st.st_mode & 07777) != (mode & 07777))
+			report(NULL, name, "mode %04o, expected %04o", (int)(st.st_mode & 07777), (int)(mode & 07777));
+		if (S_ISLNK(mode) && target) {
+			buf = malloc(st.st_size + 1);
+			if (!buf)
+				fatal(NULL);
+			++stats[STATSYSCALLS];
+			ret = readlinkat(fd, base, buf, st.st_size + 1);
+			if (ret < 0)
+				fatal("readlink %s:", name);
+			if (ret != strlen(target) || memcmp(buf, target, ret) != 0)
+				report(NULL, name, "target differs");
+			free(buf);
+		}
+		if (S_ISREG(mode) && size != -1 && st.st_size != size) {
+			report(NULL, name, "size %lld, expected %lld", (long long)st.st_size, (long long)size);
+		} else if (S_ISREG(mode) && hash && (rate >= 1 || drand48() < rate)) {
+			s = slotnew(NULL, name);
+			memcpy(s->hash, hash, sizeof(s->hash));
+			s->job = 1;
+			s->done = 0;
+			slotadd(s);
+		}
+	}
+	if (S_ISDIR(mode)) {
+		int dfd = -1;
+
+		if (S_ISDIR(st.st_mode)) {
+			++stats[STATSYSCALLS];
+			dfd = openat(fd, base, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (dfd < 0)
+				fatal("open %s:", name);
+		}
+		dirpush(dfd, name, 1);
+	}
+	statphase(phase);
+	tracerecord("");
+}
+
+static void
+verifyend(struct stage *s)
+{
+	while (dir)
+		dirpop();
+	drain(0);
+	fflush(stdout);
+	if (ferror(stdout))
+		fatal("write:");
+}
+
+/* a sink that reports how the tree at rootdir differs from the records */
+struct stage *
+verifystage(char *rootdir, const struct verifyopt *opt)
+{
+	static struct stage s = {verifyrecord, verifyend};
+	pthread_t tid;
+	long i, nthreads;
+
+	root = rootdir;
+	rate = opt->rate;
+	srand48(time(NULL) ^ getpid());
+	rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (rootfd < 0)
+		fatal("open %s:", root);
+	nthreads = opt->threads;
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+	for (i = 0; i < nthreads; ++i) {
+		if (pthread_create(&tid, NULL, worker, NULL) != 0)
+			fatal("pthread_create:");
+	}
+	return &s;
+}
+
+/* the number of differences reported */
+unsigned long long
+verifydiffs(void)
+{
+	return ndiffs;
+}